@@ -0,0 +1,404 @@
+//
+// cell_store.h
+// ~~~~~~~~~~~~
+//
+// Storage for the cells of one spreadsheet, keyed by packed (column, row) coordinates.
+//
+
+#ifndef CELL_STORE_H
+#define CELL_STORE_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/*
+*	A cell name such as "A1" or "bc12" is parsed once into a cell_key: the column in the high
+*	32 bits (A = 0, Z = 25, AA = 26, ...) and the row as written in the low 32 bits.  Ordering
+*	keys orders cells by column and then by row, so A2 sorts before A10.
+*/
+typedef boost::uint64_t cell_key;
+
+/*
+*	The cell_store holds the contents of every cell of a spreadsheet.
+*
+*	Each cell that is ever named gets a small integer cell_id the first time it is seen.  Ids
+*	are never reused, so other structures (dependencies, undo records) can refer to cells by
+*	id.  Lookups go through an open-addressing hash table from key to id, so finding a cell is
+*	O(1) and never compares strings.
+*
+*	Contents live in one byte arena; each id records the offset and length of its contents.
+*	A change that fits where the old contents were is written in place, anything bigger is
+*	appended, and the arena is compacted once more than half of it is stale.  Empty contents
+*	mean the cell is unused.
+*
+*	Ids sorted by key are cached and only re-sorted after new cells are named, so walking the
+*	used cells in order for a save is a linear pass.
+*/
+class cell_store
+{
+public:
+	typedef boost::uint32_t cell_id;
+	static const cell_id npos = 0xffffffff;
+
+	cell_store()
+		: table_(initial_table_size, 0), used_(0), garbage_(0), sorted_valid_(true)
+	{
+	}
+
+	/*
+	*	Parses a cell name into its key.  Letters are case-insensitive.  Returns false if the name
+	*	is not one or more letters followed by a row number without leading zeros.
+	*/
+	static bool parse_name(boost::string_ref name, cell_key& key)
+	{
+		std::size_t i = 0;
+		boost::uint64_t column = 0;
+		for(; i < name.size(); i++)
+		{
+			char c = name[i];
+			if(c >= 'a' && c <= 'z')
+				c -= 'a' - 'A';
+			if(c < 'A' || c > 'Z')
+				break;
+			//six letters is already past any real sheet
+			if(i == 6)
+				return false;
+			column = column * 26 + (c - 'A' + 1);
+		}
+		if(i == 0 || i == name.size() || name[i] == '0')
+			return false;
+
+		boost::uint64_t row = 0;
+		std::size_t digits = 0;
+		for(; i < name.size(); i++, digits++)
+		{
+			char c = name[i];
+			if(c < '0' || c > '9' || digits == 9)
+				return false;
+			row = row * 10 + (c - '0');
+		}
+
+		key = ((column - 1) << 32) | row;
+		return true;
+	}
+
+	static boost::uint32_t column(cell_key key)
+	{
+		return static_cast<boost::uint32_t>(key >> 32);
+	}
+
+	static boost::uint32_t row(cell_key key)
+	{
+		return static_cast<boost::uint32_t>(key);
+	}
+
+	/*
+	*	Appends the canonical (upper case) name of the cell to out.
+	*/
+	static void append_name(cell_key key, std::string& out)
+	{
+		char letters[8];
+		int count = 0;
+		boost::uint64_t col = column(key) + 1;
+		while(col > 0)
+		{
+			letters[count++] = 'A' + (col - 1) % 26;
+			col = (col - 1) / 26;
+		}
+		while(count > 0)
+			out += letters[--count];
+
+		char digits[12];
+		count = 0;
+		boost::uint32_t r = row(key);
+		do
+		{
+			digits[count++] = '0' + r % 10;
+			r /= 10;
+		} while(r > 0);
+		while(count > 0)
+			out += digits[--count];
+	}
+
+	static std::string name(cell_key key)
+	{
+		std::string result;
+		append_name(key, result);
+		return result;
+	}
+
+	/*
+	*	Returns the id of the cell, giving it one if it has never been named.
+	*/
+	cell_id intern(cell_key key)
+	{
+		std::size_t slot = probe(key);
+		if(table_[slot] != 0)
+			return table_[slot] - 1;
+
+		cell_id id = keys_.size();
+		keys_.push_back(key);
+		entry empty = { 0, 0 };
+		entries_.push_back(empty);
+		table_[slot] = id + 1;
+		sorted_valid_ = false;
+
+		//keep the table at most half full
+		if(keys_.size() * 2 > table_.size())
+			grow();
+		return id;
+	}
+
+	/*
+	*	Makes room for count more cells holding bytes of contents in all, so loading a sheet of
+	*	known size neither rehashes nor regrows the arena.
+	*/
+	void reserve(std::size_t count, std::size_t bytes)
+	{
+		count += keys_.size();
+		keys_.reserve(count);
+		entries_.reserve(count);
+		arena_.reserve(arena_.size() + bytes);
+		std::size_t size = table_.size();
+		while(size < count * 2)
+			size *= 2;
+		if(size != table_.size())
+			rehash(size);
+	}
+
+	/*
+	*	Returns the id of the cell, or npos if it has never been named.
+	*/
+	cell_id find(cell_key key) const
+	{
+		std::size_t slot = probe(key);
+		return table_[slot] == 0 ? npos : table_[slot] - 1;
+	}
+
+	cell_key key(cell_id id) const
+	{
+		return keys_[id];
+	}
+
+	/*
+	*	Returns the contents of the cell.  The view is only valid until the next set().
+	*/
+	boost::string_ref contents(cell_id id) const
+	{
+		const entry& e = entries_[id];
+		if(e.length == 0)
+			return boost::string_ref();
+		return boost::string_ref(&arena_[e.offset], e.length);
+	}
+
+	/*
+	*	Replaces the contents of the cell.  Empty contents clear it.
+	*/
+	void set(cell_id id, boost::string_ref contents)
+	{
+		entry& e = entries_[id];
+		if(e.length != 0)
+			used_--;
+		if(contents.empty())
+		{
+			garbage_ += e.length;
+			e.length = 0;
+			return;
+		}
+		used_++;
+
+		//reuse the old bytes when the new contents fit
+		if(contents.size() <= e.length)
+		{
+			std::memcpy(&arena_[e.offset], contents.data(), contents.size());
+			garbage_ += e.length - contents.size();
+			e.length = contents.size();
+			return;
+		}
+
+		garbage_ += e.length;
+		e.offset = arena_.size();
+		e.length = contents.size();
+		arena_.insert(arena_.end(), contents.begin(), contents.end());
+
+		if(garbage_ > compact_threshold && garbage_ * 2 > arena_.size())
+			compact();
+	}
+
+	/*
+	*	The number of cells with contents.
+	*/
+	std::size_t size() const
+	{
+		return used_;
+	}
+
+	/*
+	*	The number of cells that have an id.  Ids run from 0 to id_count() - 1.
+	*/
+	std::size_t id_count() const
+	{
+		return keys_.size();
+	}
+
+	/*
+	*	Brings the cached key order up to date with the ids named since the last sort.
+	*/
+	void sort()
+	{
+		if(!sorted_valid_)
+		{
+			merge_new_ids(sorted_);
+			sorted_valid_ = true;
+		}
+	}
+
+	/*
+	*	Every id, ordered by key.  Cells without contents are included.
+	*/
+	const std::vector<cell_id>& sorted_ids()
+	{
+		sort();
+		return sorted_;
+	}
+
+	/*
+	*	Calls f(key, contents) for every cell with contents, ordered by key.  Cheapest right
+	*	after sort(); otherwise the ids named since then are merged into a temporary order.
+	*/
+	template <typename Function>
+	void for_each_sorted(Function f) const
+	{
+		if(sorted_valid_)
+		{
+			visit(sorted_, f);
+			return;
+		}
+		std::vector<cell_id> ids(sorted_);
+		merge_new_ids(ids);
+		visit(ids, f);
+	}
+
+	/*
+	*	The bytes held by the store.
+	*/
+	std::size_t memory_usage() const
+	{
+		return table_.capacity() * sizeof(boost::uint32_t) + keys_.capacity() * sizeof(cell_key) +
+			entries_.capacity() * sizeof(entry) + arena_.capacity() + sorted_.capacity() * sizeof(cell_id);
+	}
+
+private:
+	enum { initial_table_size = 64, compact_threshold = 64 * 1024 };
+
+	struct entry
+	{
+		boost::uint32_t offset;
+		boost::uint32_t length;
+	};
+
+	struct key_less
+	{
+		explicit key_less(const std::vector<cell_key>& keys) : keys_(keys) {}
+		bool operator()(cell_id a, cell_id b) const { return keys_[a] < keys_[b]; }
+		const std::vector<cell_key>& keys_;
+	};
+
+	/*
+	*	Appends the ids missing from ids, which must be sorted, and restores the order.
+	*/
+	void merge_new_ids(std::vector<cell_id>& ids) const
+	{
+		std::size_t old_size = ids.size();
+		for(cell_id id = old_size; id < keys_.size(); id++)
+			ids.push_back(id);
+		key_less less(keys_);
+		std::sort(ids.begin() + old_size, ids.end(), less);
+		std::inplace_merge(ids.begin(), ids.begin() + old_size, ids.end(), less);
+	}
+
+	template <typename Function>
+	void visit(const std::vector<cell_id>& ids, Function& f) const
+	{
+		for(std::size_t i = 0; i < ids.size(); i++)
+		{
+			const entry& e = entries_[ids[i]];
+			if(e.length != 0)
+				f(keys_[ids[i]], boost::string_ref(&arena_[e.offset], e.length));
+		}
+	}
+
+	static std::size_t hash(cell_key key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		return static_cast<std::size_t>(key);
+	}
+
+	/*
+	*	Returns the slot holding the key, or the empty slot where it would go.
+	*/
+	std::size_t probe(cell_key key) const
+	{
+		std::size_t mask = table_.size() - 1;
+		std::size_t slot = hash(key) & mask;
+		while(table_[slot] != 0 && keys_[table_[slot] - 1] != key)
+			slot = (slot + 1) & mask;
+		return slot;
+	}
+
+	void grow()
+	{
+		rehash(table_.size() * 2);
+	}
+
+	void rehash(std::size_t size)
+	{
+		std::vector<boost::uint32_t> old;
+		old.swap(table_);
+		table_.assign(size, 0);
+		for(std::size_t i = 0; i < old.size(); i++)
+			if(old[i] != 0)
+				table_[probe(keys_[old[i] - 1])] = old[i];
+	}
+
+	/*
+	*	Copies the live contents to a fresh arena.
+	*/
+	void compact()
+	{
+		std::vector<char> fresh;
+		fresh.reserve(arena_.size() - garbage_);
+		for(std::size_t id = 0; id < entries_.size(); id++)
+		{
+			entry& e = entries_[id];
+			if(e.length == 0)
+				continue;
+			boost::uint32_t offset = fresh.size();
+			fresh.insert(fresh.end(), arena_.begin() + e.offset, arena_.begin() + e.offset + e.length);
+			e.offset = offset;
+		}
+		arena_.swap(fresh);
+		garbage_ = 0;
+	}
+
+	// Open-addressing table of id + 1, 0 marks an empty slot
+	std::vector<boost::uint32_t> table_;
+	// The key and contents of each id
+	std::vector<cell_key> keys_;
+	std::vector<entry> entries_;
+	// Contents of every cell, plus stale bytes from overwritten ones
+	std::vector<char> arena_;
+	std::size_t used_;
+	std::size_t garbage_;
+	// Every id ordered by key
+	std::vector<cell_id> sorted_;
+	bool sorted_valid_;
+};
+
+#endif
@@ -0,0 +1,373 @@
+//
+// change_journal.h
+// ~~~~~~~~~~~~~~~~
+//
+// Append-only write-ahead journal of the committed changes to one spreadsheet.
+//
+
+#ifndef CHANGE_JOURNAL_H
+#define CHANGE_JOURNAL_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/crc.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include "server_log.h"
+
+/*
+*	The change_journal records every committed CHANGE and UNDO of a spreadsheet as a
+*	"set this cell to these contents" record appended to <xml file>.journal.  Empty contents
+*	mean the cell was cleared.  The spreadsheet on disk is the xml snapshot with the journal
+*	replayed on top of it, so making a change durable costs an fsync of the few bytes appended
+*	since the last one instead of rewriting the whole file.
+*
+*	Each record is laid out in host byte order as
+*	length    u32   size of the payload
+*	checksum  u32   crc32 of the payload
+*	payload         u32 cell name length, cell name, u32 contents length, contents
+*
+*	The payload of a record written for a batch of changes holds one such entry per cell, so
+*	the whole batch is replayed or none of it is.  A torn or corrupt record ends the journal;
+*	replay() drops it and everything after it.
+*
+*	Compaction folds the journal into the sheet file.  The snapshot is written from a copy of
+*	the cells that holds every record so far, so once it is durable the journal can start over
+*	empty.  begin_compaction() marks that point, and from then on the journal also keeps a copy
+*	of each record appended.  replace_file() puts a new, empty journal in place of the old one,
+*	off the thread that appends, and finish_compaction() switches to it, carrying over the
+*	records kept since.  Records only ever set a cell to a value, so replaying records the
+*	snapshot already contains is harmless: a crash anywhere during compaction still recovers
+*	the same cells.
+*/
+class change_journal
+{
+public:
+	typedef boost::function<void (const std::string&, const std::string&)> record_handler;
+	typedef std::pair<std::string, std::string> entry;
+
+	change_journal()
+		: fd_(-1), size_(0), keeping_(false)
+	{
+	}
+
+	~change_journal()
+	{
+		close();
+	}
+
+	/*
+	*	Replays the journal at path, calling handler with the cell name and contents of every
+	*	intact record in order, then opens it for appending after the last intact record.
+	*	Returns false if the journal could not be opened.
+	*/
+	bool open(const std::string& path, record_handler handler)
+	{
+		close();
+		path_ = path;
+		size_ = replay(path, handler);
+
+		fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+		if(fd_ < 0)
+		{
+			LOG_ERROR("Error: Could not open journal " << path);
+			return false;
+		}
+		//Drop a torn record left by a crash so new records follow intact ones
+		if(::ftruncate(fd_, size_) != 0 || ::lseek(fd_, size_, SEEK_SET) < 0)
+		{
+			LOG_ERROR("Error: Could not truncate journal " << path);
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	/*
+	*	Appends a record.  The record reaches the page cache immediately but is only durable
+	*	after the next sync().
+	*/
+	bool append(const std::string& cell, const std::string& contents)
+	{
+		return append(std::vector<entry>(1, entry(cell, contents)));
+	}
+
+	/*
+	*	Appends one record holding every (cell, contents) entry of a batch, in order.
+	*/
+	bool append(const std::vector<entry>& entries)
+	{
+		if(fd_ < 0 || entries.empty())
+			return false;
+
+		boost::uint32_t payload_length = 0;
+		for(std::size_t i = 0; i < entries.size(); i++)
+			payload_length += 8 + entries[i].first.size() + entries[i].second.size();
+
+		record_.resize(8 + payload_length);
+		char* out = &record_[8];
+		for(std::size_t i = 0; i < entries.size(); i++)
+		{
+			boost::uint32_t cell_length = entries[i].first.size();
+			boost::uint32_t contents_length = entries[i].second.size();
+			std::memcpy(out, &cell_length, 4);
+			std::memcpy(out + 4, entries[i].first.data(), cell_length);
+			std::memcpy(out + 4 + cell_length, &contents_length, 4);
+			std::memcpy(out + 8 + cell_length, entries[i].second.data(), contents_length);
+			out += 8 + cell_length + contents_length;
+		}
+		out = &record_[8];
+
+		boost::crc_32_type crc;
+		crc.process_bytes(out, payload_length);
+		boost::uint32_t checksum = crc.checksum();
+		std::memcpy(&record_[0], &payload_length, 4);
+		std::memcpy(&record_[4], &checksum, 4);
+
+		if(!write_all(fd_, &record_[0], record_.size()))
+		{
+			LOG_ERROR("Error: Could not append to journal " << path_);
+			//Drop the part of the record that was written so later records follow intact ones;
+			//if that fails too, stop appending rather than write after a torn record
+			if(::ftruncate(fd_, size_) != 0 || ::lseek(fd_, size_, SEEK_SET) < 0)
+			{
+				LOG_ERROR("Error: Could not truncate journal " << path_);
+				close();
+			}
+			return false;
+		}
+		size_ += record_.size();
+		//the replacement being made does not have this record yet
+		if(keeping_)
+			kept_.insert(kept_.end(), record_.begin(), record_.end());
+		return true;
+	}
+
+	/*
+	*	Makes every appended record durable.  Only touches the file, so it may run on another
+	*	thread while records are appended, as long as the journal is not opened or compacted
+	*	meanwhile.
+	*/
+	bool sync() const
+	{
+		if(fd_ < 0)
+			return false;
+		return ::fdatasync(fd_) == 0;
+	}
+
+	/*
+	*	Starts a compaction: every record so far is in the snapshot being written, and records
+	*	appended from now on are kept for the replacement journal as well.
+	*/
+	void begin_compaction()
+	{
+		keeping_ = true;
+		kept_.clear();
+	}
+
+	/*
+	*	Puts a new, empty journal in place of this one atomically, and returns it open for
+	*	appending, or -1 if it could not.  Only touches the file system, so it may run on another
+	*	thread while records are appended; they go to the old journal until finish_compaction().
+	*/
+	int replace_file() const
+	{
+		std::string temp = path_ + ".tmp";
+		int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(out < 0)
+			return -1;
+		if(::fsync(out) != 0 || ::rename(temp.c_str(), path_.c_str()) != 0)
+		{
+			::close(out);
+			::unlink(temp.c_str());
+			return -1;
+		}
+		sync_directory(path_);
+		return out;
+	}
+
+	/*
+	*	Ends a compaction.  With the journal replace_file() returned, new records go to it,
+	*	starting with those appended since begin_compaction(); with -1 the compaction failed and
+	*	the journal carries on as it was.  Returns false if the kept records could not be written.
+	*/
+	bool finish_compaction(int fd)
+	{
+		keeping_ = false;
+		if(fd < 0)
+		{
+			kept_.clear();
+			return false;
+		}
+		bool written = kept_.empty() || write_all(fd, &kept_[0], kept_.size());
+		close();
+		fd_ = fd;
+		size_ = kept_.size();
+		kept_.clear();
+		return written;
+	}
+
+	/*
+	*	The number of bytes in the journal.
+	*/
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+	/*
+	*	Writes data to path durably: into a temporary file that is synced and then renamed over
+	*	path, so readers see either the old file or the whole new one.
+	*/
+	static bool write_file(const std::string& path, const std::string& data)
+	{
+		std::string temp = path + ".tmp";
+		int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+		if(!write_all(fd, data.data(), data.size()) || ::fsync(fd) != 0)
+		{
+			::close(fd);
+			::unlink(temp.c_str());
+			return false;
+		}
+		::close(fd);
+		if(::rename(temp.c_str(), path.c_str()) != 0)
+		{
+			::unlink(temp.c_str());
+			return false;
+		}
+		sync_directory(path);
+		return true;
+	}
+
+	/*
+	*	Writes all of data to fd, retrying short writes.
+	*/
+	static bool write_all(int fd, const char* data, std::size_t size)
+	{
+		while(size > 0)
+		{
+			ssize_t n = ::write(fd, data, size);
+			if(n <= 0)
+				return false;
+			data += n;
+			size -= n;
+		}
+		return true;
+	}
+
+	/*
+	*	Syncs the directory holding path so a rename into it is durable.
+	*/
+	static void sync_directory(const std::string& path)
+	{
+		std::string::size_type slash = path.rfind('/');
+		std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+		int fd = ::open(directory.c_str(), O_RDONLY);
+		if(fd >= 0)
+		{
+			::fsync(fd);
+			::close(fd);
+		}
+	}
+
+private:
+	void close()
+	{
+		if(fd_ >= 0)
+			::close(fd_);
+		fd_ = -1;
+	}
+
+	/*
+	*	Calls handler for every intact record and returns the offset just past the last one.
+	*/
+	static std::size_t replay(const std::string& path, record_handler handler)
+	{
+		std::vector<char> data;
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+			return 0;
+		char chunk[65536];
+		ssize_t n;
+		while((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+			data.insert(data.end(), chunk, chunk + n);
+		::close(fd);
+
+		std::size_t pos = 0;
+		std::string cell, contents;
+		while(data.size() - pos >= 8)
+		{
+			boost::uint32_t payload_length, checksum;
+			std::memcpy(&payload_length, &data[pos], 4);
+			std::memcpy(&checksum, &data[pos + 4], 4);
+			if(payload_length < 8 || data.size() - pos - 8 < payload_length)
+				break;
+
+			const char* payload = &data[pos + 8];
+			boost::crc_32_type crc;
+			crc.process_bytes(payload, payload_length);
+			if(crc.checksum() != checksum)
+				break;
+
+			//check every entry before applying any, a record is applied whole or not at all
+			if(!valid_entries(payload, payload_length))
+				break;
+			for(std::size_t at = 0; at < payload_length; )
+			{
+				boost::uint32_t cell_length, contents_length;
+				std::memcpy(&cell_length, payload + at, 4);
+				std::memcpy(&contents_length, payload + at + 4 + cell_length, 4);
+				cell.assign(payload + at + 4, cell_length);
+				contents.assign(payload + at + 8 + cell_length, contents_length);
+				handler(cell, contents);
+				at += 8 + cell_length + contents_length;
+			}
+
+			pos += 8 + payload_length;
+		}
+		if(pos != data.size())
+			LOG_WARN("Journal " << path << " has a torn record at " << pos << ", ignoring the rest.");
+		return pos;
+	}
+
+	/*
+	*	Checks that a payload is made of whole entries exactly.
+	*/
+	static bool valid_entries(const char* payload, std::size_t payload_length)
+	{
+		std::size_t at = 0;
+		while(at < payload_length)
+		{
+			boost::uint32_t cell_length, contents_length;
+			if(payload_length - at < 8)
+				return false;
+			std::memcpy(&cell_length, payload + at, 4);
+			if(cell_length > payload_length - at - 8)
+				return false;
+			std::memcpy(&contents_length, payload + at + 4 + cell_length, 4);
+			if(contents_length > payload_length - at - 8 - cell_length)
+				return false;
+			at += 8 + cell_length + contents_length;
+		}
+		return true;
+	}
+
+	int fd_;
+	std::string path_;
+	std::size_t size_;
+	// Reused to encode each record
+	std::vector<char> record_;
+	// Set during a compaction, and the records appended since it began
+	bool keeping_;
+	std::vector<char> kept_;
+};
+
+#endif
@@ -0,0 +1,155 @@
+//
+// column_cache.h
+// ~~~~~~~~~~~~~~
+//
+// Cell values laid out as contiguous columns of doubles for range aggregates.
+//
+
+#ifndef COLUMN_CACHE_H
+#define COLUMN_CACHE_H
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "cell_store.h"
+#include "formula.h"
+#include "range_kernels.h"
+
+/*
+*	The column_cache mirrors the value of every cell into one array per column, indexed by
+*	row, so totalling a range streams through contiguous memory with the range_kernels instead
+*	of looking cells up one at a time.  Each column holds three parallel arrays:
+*
+*	values  the number, or 0 where the cell is not a number
+*	mask    all ones where the cell is a number, 0 elsewhere
+*	kinds   the cell_value kind, scanned with memchr to find errors in a range
+*
+*	Columns grow to the highest row used, up to max_rows; cells further down are not cached.
+*/
+class column_cache
+{
+public:
+	enum { max_rows = 1 << 20 };
+
+	/*
+	*	Stores the value of a cell, making room for it.  Must not run alongside other calls.
+	*/
+	void set(cell_key key, const cell_value& value)
+	{
+		boost::uint32_t row = cell_store::row(key);
+		if(row == 0 || row > max_rows)
+			return;
+		column& c = columns_[cell_store::column(key)];
+		if(c.values.size() < row)
+		{
+			std::size_t size = std::max<std::size_t>(row, c.values.size() * 2);
+			if(size > max_rows)
+				size = max_rows;
+			c.values.resize(size, 0);
+			c.mask.resize(size, 0);
+			c.kinds.resize(size, cell_value::empty);
+		}
+		store(c, row - 1, value);
+	}
+
+	/*
+	*	Stores the value of a cell that set() already made room for.  Updates of different cells
+	*	may run on different threads at once, which is how parallel recalculation uses it.
+	*/
+	void update(cell_key key, const cell_value& value)
+	{
+		boost::uint32_t row = cell_store::row(key);
+		if(row == 0 || row > max_rows)
+			return;
+		std::map<boost::uint32_t, column>::iterator it = columns_.find(cell_store::column(key));
+		if(it != columns_.end() && row <= it->second.values.size())
+			store(it->second, row - 1, value);
+	}
+
+	/*
+	*	Totals the numbers in the rectangle with corners from and to.  Returns false if a cell
+	*	in it holds an error, setting error_at to the first such cell in key order.
+	*/
+	bool total(cell_key from, cell_key to, range_totals& totals, cell_key& error_at) const
+	{
+		range_kernels::kernel kernel = range_kernels::best();
+		boost::uint32_t first_row = cell_store::row(from) - 1;
+		boost::uint32_t last_row = cell_store::row(to);
+
+		std::map<boost::uint32_t, column>::const_iterator it = columns_.lower_bound(cell_store::column(from));
+		for(; it != columns_.end() && it->first <= cell_store::column(to); it++)
+		{
+			const column& c = it->second;
+			std::size_t end = std::min<std::size_t>(last_row, c.values.size());
+			if(first_row >= end)
+				continue;
+			std::size_t count = end - first_row;
+
+			const void* error = std::memchr(&c.kinds[first_row], cell_value::error, count);
+			if(error != NULL)
+			{
+				std::size_t row = static_cast<const boost::uint8_t*>(error) - &c.kinds[0] + 1;
+				error_at = (static_cast<cell_key>(it->first) << 32) | row;
+				return false;
+			}
+			kernel(&c.values[first_row], &c.mask[first_row], count, totals);
+		}
+		return true;
+	}
+
+	/*
+	*	Parses a range such as "A1:B10", or a single cell, into its top left and bottom right
+	*	corners.
+	*/
+	static bool parse_range(boost::string_ref range, cell_key& from, cell_key& to)
+	{
+		std::size_t colon = range.find(':');
+		if(colon == boost::string_ref::npos)
+		{
+			if(!cell_store::parse_name(range, from))
+				return false;
+			to = from;
+			return true;
+		}
+		cell_key a, b;
+		if(!cell_store::parse_name(range.substr(0, colon), a) || !cell_store::parse_name(range.substr(colon + 1), b))
+			return false;
+		boost::uint64_t left = std::min(cell_store::column(a), cell_store::column(b));
+		boost::uint64_t right = std::max(cell_store::column(a), cell_store::column(b));
+		from = (left << 32) | std::min(cell_store::row(a), cell_store::row(b));
+		to = (right << 32) | std::max(cell_store::row(a), cell_store::row(b));
+		return true;
+	}
+
+	std::size_t memory_usage() const
+	{
+		std::size_t bytes = 0;
+		std::map<boost::uint32_t, column>::const_iterator it;
+		for(it = columns_.begin(); it != columns_.end(); it++)
+			bytes += it->second.values.capacity() * (sizeof(double) + sizeof(boost::uint64_t) + 1);
+		return bytes;
+	}
+
+private:
+	struct column
+	{
+		std::vector<double> values;
+		std::vector<boost::uint64_t> mask;
+		std::vector<boost::uint8_t> kinds;
+	};
+
+	static void store(column& c, std::size_t index, const cell_value& value)
+	{
+		bool number = value.type == cell_value::number;
+		c.values[index] = number ? value.value : 0;
+		c.mask[index] = number ? ~boost::uint64_t(0) : 0;
+		c.kinds[index] = value.type;
+	}
+
+	std::map<boost::uint32_t, column> columns_;
+};
+
+#endif
@@ -0,0 +1,358 @@
+//
+// dependency_graph.h
+// ~~~~~~~~~~~~~~~~~~
+//
+// Dependencies between the cells of one spreadsheet, by cell id.
+//
+
+#ifndef DEPENDENCY_GRAPH_H
+#define DEPENDENCY_GRAPH_H
+
+#include <algorithm>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+/*
+*	A list of edges for each of a set of nodes, all kept in one flat vector.  Each node owns a
+*	segment of the vector with room for some edges; a node that outgrows its segment moves to
+*	a segment twice the size at the end, and the vector is compacted once more than half of it
+*	is abandoned segments.
+*/
+class flat_adjacency
+{
+public:
+	typedef boost::uint32_t node;
+
+	flat_adjacency()
+		: garbage_(0)
+	{
+	}
+
+	void resize(std::size_t count)
+	{
+		segment empty = { 0, 0, 0 };
+		segments_.resize(count, empty);
+	}
+
+	const node* begin(node n) const
+	{
+		return edges_.empty() ? NULL : &edges_[0] + segments_[n].offset;
+	}
+
+	const node* end(node n) const
+	{
+		return begin(n) + segments_[n].count;
+	}
+
+	std::size_t count(node n) const
+	{
+		return segments_[n].count;
+	}
+
+	/*
+	*	Replaces the edges of n.
+	*/
+	void assign(node n, const node* first, const node* last)
+	{
+		std::size_t count = last - first;
+		reserve(n, count);
+		std::copy(first, last, edges_.begin() + segments_[n].offset);
+		segments_[n].count = count;
+	}
+
+	void add(node n, node target)
+	{
+		segment& s = segments_[n];
+		reserve(n, s.count + 1);
+		edges_[segments_[n].offset + segments_[n].count++] = target;
+	}
+
+	/*
+	*	Removes one edge from n to target.  The order of the remaining edges is not kept.
+	*/
+	void remove(node n, node target)
+	{
+		segment& s = segments_[n];
+		node* first = &edges_[s.offset];
+		for(boost::uint32_t i = 0; i < s.count; i++)
+			if(first[i] == target)
+			{
+				first[i] = first[--s.count];
+				return;
+			}
+	}
+
+	std::size_t memory_usage() const
+	{
+		return edges_.capacity() * sizeof(node) + segments_.capacity() * sizeof(segment);
+	}
+
+private:
+	struct segment
+	{
+		boost::uint32_t offset;
+		boost::uint32_t count;
+		boost::uint32_t capacity;
+	};
+
+	/*
+	*	Makes room for count edges in the segment of n.
+	*/
+	void reserve(node n, std::size_t count)
+	{
+		segment& s = segments_[n];
+		if(count <= s.capacity)
+			return;
+
+		boost::uint32_t capacity = std::max<std::size_t>(count, s.capacity * 2);
+		if(capacity < 2)
+			capacity = 2;
+		boost::uint32_t offset = edges_.size();
+		edges_.resize(edges_.size() + capacity);
+		std::copy(edges_.begin() + s.offset, edges_.begin() + s.offset + s.count, edges_.begin() + offset);
+		garbage_ += s.capacity;
+		s.offset = offset;
+		s.capacity = capacity;
+
+		if(garbage_ > compact_threshold && garbage_ * 2 > edges_.size())
+			compact();
+	}
+
+	void compact()
+	{
+		std::vector<node> fresh;
+		fresh.reserve(edges_.size() - garbage_);
+		for(std::size_t n = 0; n < segments_.size(); n++)
+		{
+			segment& s = segments_[n];
+			boost::uint32_t offset = fresh.size();
+			fresh.insert(fresh.end(), edges_.begin() + s.offset, edges_.begin() + s.offset + s.capacity);
+			s.offset = offset;
+		}
+		edges_.swap(fresh);
+		garbage_ = 0;
+	}
+
+	enum { compact_threshold = 16 * 1024 };
+
+	std::vector<node> edges_;
+	std::vector<segment> segments_;
+	std::size_t garbage_;
+};
+
+/*
+*	The dependency_graph records which cells each formula cell refers to (its precedents) and,
+*	for each cell, which formula cells refer to it (its dependents).  Nodes are cell ids from
+*	the session's cell_store, and both directions are flat_adjacency lists, so walking the
+*	graph touches small integer arrays only.
+*
+*	The graph is kept free of cycles: a change is checked with dependents_of() before its
+*	precedents are set, and the same walk yields the cells that need recomputing, in an order
+*	where every cell comes after the cells it refers to.  The cost is proportional to the cells
+*	the change affects, not to the size of the sheet.
+*/
+class dependency_graph
+{
+public:
+	typedef boost::uint32_t node;
+
+	dependency_graph()
+		: epoch_(0)
+	{
+	}
+
+	/*
+	*	Makes room for nodes 0 to count - 1.
+	*/
+	void resize(std::size_t count)
+	{
+		if(count <= marks_.size())
+			return;
+		precedents_.resize(count);
+		dependents_.resize(count);
+		marks_.resize(count, 0);
+	}
+
+	std::size_t size() const
+	{
+		return marks_.size();
+	}
+
+	const node* precedents_begin(node n) const { return precedents_.begin(n); }
+	const node* precedents_end(node n) const { return precedents_.end(n); }
+	const node* dependents_begin(node n) const { return dependents_.begin(n); }
+	const node* dependents_end(node n) const { return dependents_.end(n); }
+
+	/*
+	*	Replaces the precedents of n, which must not make a cycle.
+	*/
+	void set_precedents(node n, const std::vector<node>& precedents)
+	{
+		for(const node* p = precedents_.begin(n); p != precedents_.end(n); p++)
+			dependents_.remove(*p, n);
+		precedents_.assign(n, precedents.empty() ? NULL : &precedents[0],
+			precedents.empty() ? NULL : &precedents[0] + precedents.size());
+		for(std::size_t i = 0; i < precedents.size(); i++)
+			dependents_.add(precedents[i], n);
+	}
+
+	/*
+	*	Fills order with n and every cell that depends on it, directly or not, so that each cell
+	*	comes after all of its precedents.  Returns false, leaving order unspecified, if giving n
+	*	the precedents new_precedents would make a cycle.
+	*/
+	bool dependents_of(node n, const std::vector<node>& new_precedents, std::vector<node>& order)
+	{
+		next_epoch();
+		order.clear();
+		visit(n, order);
+
+		//a new precedent that already depends on n closes a loop
+		for(std::size_t i = 0; i < new_precedents.size(); i++)
+			if(marks_[new_precedents[i]] == epoch_)
+				return false;
+
+		std::reverse(order.begin(), order.end());
+		return true;
+	}
+
+	/*
+	*	Fills order with every cell in roots and every cell that depends on any of them, so that
+	*	each cell comes after all of its precedents.  Used after several cells changed at once,
+	*	so the cells they share as dependents are only ordered, and recalculated, once.
+	*/
+	void dependents_of(const std::vector<node>& roots, std::vector<node>& order)
+	{
+		next_epoch();
+		order.clear();
+		for(std::size_t i = 0; i < roots.size(); i++)
+			if(marks_[roots[i]] != epoch_)
+				visit(roots[i], order);
+		std::reverse(order.begin(), order.end());
+	}
+
+	/*
+	*	Splits order, which must be the result of the last dependents_of() or topological_order(),
+	*	into levels.  A
+	*	cell's level is one more than the highest level among its precedents in order, so the
+	*	cells of one level never depend on each other and can be evaluated at the same time once
+	*	the levels before it are done.  by_level lists the cells of level 0, then level 1, and so
+	*	on, each level in the relative order it had in order; level l is by_level[starts[l]] up
+	*	to by_level[starts[l + 1]].
+	*/
+	void levels(const std::vector<node>& order, std::vector<node>& by_level, std::vector<std::size_t>& starts)
+	{
+		levels_.resize(size());
+		boost::uint32_t deepest = 0;
+		for(std::size_t i = 0; i < order.size(); i++)
+		{
+			node n = order[i];
+			boost::uint32_t level = 0;
+			for(const node* p = precedents_.begin(n); p != precedents_.end(n); p++)
+				if(marks_[*p] == epoch_ && levels_[*p] + 1 > level)
+					level = levels_[*p] + 1;
+			levels_[n] = level;
+			deepest = std::max(deepest, level);
+		}
+
+		//counting sort by level keeps the order within each level
+		starts.assign(deepest + 2, 0);
+		for(std::size_t i = 0; i < order.size(); i++)
+			starts[levels_[order[i]] + 1]++;
+		for(std::size_t l = 1; l < starts.size(); l++)
+			starts[l] += starts[l - 1];
+		by_level.resize(order.size());
+		std::vector<std::size_t> next(starts.begin(), starts.end() - 1);
+		for(std::size_t i = 0; i < order.size(); i++)
+			by_level[next[levels_[order[i]]]++] = order[i];
+	}
+
+	/*
+	*	Fills order with every node so that each comes after its precedents.  Nodes on a cycle,
+	*	and the nodes that depend on them, cannot be ordered and go to cyclic instead.  Like
+	*	dependents_of(), the order can then be split with levels().
+	*/
+	void topological_order(std::vector<node>& order, std::vector<node>& cyclic)
+	{
+		std::size_t count = size();
+		std::vector<boost::uint32_t> waiting(count);
+		order.clear();
+		cyclic.clear();
+		for(node n = 0; n < count; n++)
+		{
+			waiting[n] = precedents_.count(n);
+			if(waiting[n] == 0)
+				order.push_back(n);
+		}
+		for(std::size_t i = 0; i < order.size(); i++)
+			for(const node* d = dependents_.begin(order[i]); d != dependents_.end(order[i]); d++)
+				if(--waiting[*d] == 0)
+					order.push_back(*d);
+		if(order.size() != count)
+			for(node n = 0; n < count; n++)
+				if(waiting[n] != 0)
+					cyclic.push_back(n);
+
+		next_epoch();
+		for(std::size_t i = 0; i < order.size(); i++)
+			marks_[order[i]] = epoch_;
+	}
+
+	std::size_t memory_usage() const
+	{
+		return precedents_.memory_usage() + dependents_.memory_usage() +
+			(marks_.capacity() + levels_.capacity()) * sizeof(boost::uint32_t);
+	}
+
+private:
+	/*
+	*	Walks depth first over dependent edges from n, which this walk has not reached yet,
+	*	appending each cell to order as it finishes.
+	*/
+	void visit(node n, std::vector<node>& order)
+	{
+		std::vector<std::pair<node, boost::uint32_t> >& stack = stack_;
+		stack.clear();
+		marks_[n] = epoch_;
+		stack.push_back(std::make_pair(n, 0u));
+		while(!stack.empty())
+		{
+			std::pair<node, boost::uint32_t>& top = stack.back();
+			if(top.second < dependents_.count(top.first))
+			{
+				node next = dependents_.begin(top.first)[top.second++];
+				if(marks_[next] != epoch_)
+				{
+					marks_[next] = epoch_;
+					stack.push_back(std::make_pair(next, 0u));
+				}
+			}
+			else
+			{
+				order.push_back(top.first);
+				stack.pop_back();
+			}
+		}
+	}
+
+	void next_epoch()
+	{
+		//marks from earlier walks only need clearing when the counter wraps
+		if(++epoch_ == 0)
+		{
+			std::fill(marks_.begin(), marks_.end(), 0);
+			epoch_ = 1;
+		}
+	}
+
+	flat_adjacency precedents_;
+	flat_adjacency dependents_;
+	// marks_[n] == epoch_ when the current walk has reached n
+	std::vector<boost::uint32_t> marks_;
+	boost::uint32_t epoch_;
+	std::vector<std::pair<node, boost::uint32_t> > stack_;
+	// The level of each node of the last levels() call
+	std::vector<boost::uint32_t> levels_;
+};
+
+#endif
@@ -0,0 +1,524 @@
+//
+// formula.h
+// ~~~~~~~~~
+//
+// Tokenizer, parser and evaluator for cell formulas, following the grammar of the
+// client's Formula class.
+//
+
+#ifndef FORMULA_H
+#define FORMULA_H
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "cell_store.h"
+
+/*
+*	The value of a cell.  Contents that parse as a number are numbers, contents starting with
+*	'=' are formulas and evaluate to a number or an error, anything else is text.
+*/
+struct cell_value
+{
+	enum kind { empty, number, text, error };
+	enum error_reason { no_error, bad_reference, divide_by_zero, circular };
+
+	kind type;
+	double value;
+	error_reason reason;
+
+	cell_value()
+		: type(empty), value(0), reason(no_error)
+	{
+	}
+
+	static cell_value make(kind type, double value = 0, error_reason reason = no_error)
+	{
+		cell_value result;
+		result.type = type;
+		result.value = value;
+		result.reason = reason;
+		return result;
+	}
+
+	/*
+	*	The message a client shows for an error, matching the client's FormulaError reasons.
+	*/
+	static const char* describe(error_reason reason)
+	{
+		switch(reason)
+		{
+		case bad_reference:
+			return "*ERROR: Cannot find valid values for variables.";
+		case divide_by_zero:
+			return "*ERROR: Cannot divide by zero.";
+		case circular:
+			return "*ERROR: Circular reference.";
+		default:
+			return "*ERROR: Cannot evaluate expression.";
+		}
+	}
+
+	/*
+	*	Appends the value as a client displays it.  Text cells are written by the caller, who
+	*	holds the contents.
+	*/
+	void append_to(std::string& out) const
+	{
+		if(type == number)
+			append_number(value, out);
+		else if(type == error)
+			out += describe(reason);
+	}
+
+	/*
+	*	Formats a number with 15 significant digits, like the client's double.ToString().
+	*/
+	static void append_number(double value, std::string& out)
+	{
+		if(value != value)
+		{
+			out += "NaN";
+			return;
+		}
+		if(value == HUGE_VAL || value == -HUGE_VAL)
+		{
+			out += value > 0 ? "Infinity" : "-Infinity";
+			return;
+		}
+		char buffer[32];
+		int length = std::snprintf(buffer, sizeof(buffer), "%.15G", value);
+		out.append(buffer, length);
+	}
+};
+
+/*
+*	Returns true if the whole of text is a number, the way the client's double.TryParse reads
+*	cell contents: optional surrounding white space, an optional sign, digits with an optional
+*	decimal point, and an optional exponent.
+*/
+inline bool parse_number(boost::string_ref text, double& result)
+{
+	while(!text.empty() && std::isspace(static_cast<unsigned char>(text.front())))
+		text.remove_prefix(1);
+	while(!text.empty() && std::isspace(static_cast<unsigned char>(text.back())))
+		text.remove_suffix(1);
+
+	if(text == "NaN" || text == "Infinity" || text == "-Infinity")
+	{
+		result = text == "NaN" ? std::strtod("nan", NULL) : (text[0] == '-' ? -HUGE_VAL : HUGE_VAL);
+		return true;
+	}
+
+	std::size_t i = 0;
+	if(i < text.size() && (text[i] == '+' || text[i] == '-'))
+		i++;
+	std::size_t digits = 0;
+	for(; i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])); i++)
+		digits++;
+	if(i < text.size() && text[i] == '.')
+		for(i++; i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])); i++)
+			digits++;
+	if(digits == 0)
+		return false;
+	if(i < text.size() && (text[i] == 'e' || text[i] == 'E'))
+	{
+		i++;
+		if(i < text.size() && (text[i] == '+' || text[i] == '-'))
+			i++;
+		std::size_t exponent_digits = 0;
+		for(; i < text.size() && std::isdigit(static_cast<unsigned char>(text[i])); i++)
+			exponent_digits++;
+		if(exponent_digits == 0)
+			return false;
+	}
+	if(i != text.size())
+		return false;
+
+	result = std::strtod(std::string(text.data(), text.size()).c_str(), NULL);
+	return true;
+}
+
+/*
+*	Returns true if the contents are a formula: their first non-blank character is '='.
+*/
+inline bool is_formula(boost::string_ref contents)
+{
+	for(std::size_t i = 0; i < contents.size(); i++)
+		if(!std::isspace(static_cast<unsigned char>(contents[i])))
+			return contents[i] == '=';
+	return false;
+}
+
+/*
+*	A parsed formula.  The expression is compiled to postfix code over a stack of doubles, so
+*	evaluating it is one pass over a small array with no string handling.  Cell references are
+*	listed once each in references(), and the code refers to them by index.
+*
+*	The grammar is the client's: numbers ("2", "2.", ".5", "1e-3"), variables (letters then
+*	digits), the operators + - * / with the usual precedence, left to right, and parentheses.
+*	There is no unary minus.  A variable that is not a cell name (such as "A01") is allowed
+*	but evaluates to an error, as it does in the client.
+*/
+class formula
+{
+public:
+	formula()
+		: max_depth_(0)
+	{
+	}
+
+	/*
+	*	Parses the contents of a formula cell, the '=' included.  Returns false and sets error
+	*	to the client's explanation if the formula is not valid.
+	*/
+	bool parse(boost::string_ref contents, std::string& error)
+	{
+		code_.clear();
+		numbers_.clear();
+		references_.clear();
+
+		//drop the '=' and anything before it
+		std::size_t equals = contents.find('=');
+		if(equals != boost::string_ref::npos)
+			contents.remove_prefix(equals + 1);
+
+		std::vector<token> tokens;
+		if(!tokenize(contents, tokens))
+		{
+			error = "Formula expression contains invalid operators, numbers or variables.";
+			return false;
+		}
+		if(!validate(tokens, error))
+			return false;
+		compile(tokens);
+		return true;
+	}
+
+	/*
+	*	The cells the formula refers to, each listed once.
+	*/
+	const std::vector<cell_key>& references() const
+	{
+		return references_;
+	}
+
+	/*
+	*	Evaluates the formula.  lookup(cell_key) must return the cell_value of a referenced cell;
+	*	anything but a number makes the result a bad_reference error.
+	*/
+	template <typename Lookup>
+	cell_value evaluate(Lookup lookup) const
+	{
+		double stack[max_inline_depth];
+		std::vector<double> heap;
+		double* top = stack;
+		if(max_depth_ > max_inline_depth)
+		{
+			heap.resize(max_depth_);
+			top = &heap[0];
+		}
+		double* base = top;
+
+		for(std::size_t i = 0; i < code_.size(); i++)
+		{
+			const instruction& in = code_[i];
+			switch(in.op)
+			{
+			case push_number:
+				*top++ = numbers_[in.operand];
+				break;
+			case push_cell:
+			{
+				cell_value v = lookup(references_[in.operand]);
+				if(v.type != cell_value::number)
+					return cell_value::make(cell_value::error, 0, cell_value::bad_reference);
+				*top++ = v.value;
+				break;
+			}
+			case push_invalid:
+				return cell_value::make(cell_value::error, 0, cell_value::bad_reference);
+			case add:
+				top--;
+				top[-1] += top[0];
+				break;
+			case subtract:
+				top--;
+				top[-1] -= top[0];
+				break;
+			case multiply:
+				top--;
+				top[-1] *= top[0];
+				break;
+			case divide:
+				top--;
+				if(top[0] == 0)
+					return cell_value::make(cell_value::error, 0, cell_value::divide_by_zero);
+				top[-1] /= top[0];
+				break;
+			}
+		}
+		return cell_value::make(cell_value::number, top > base ? top[-1] : 0);
+	}
+
+private:
+	enum { max_inline_depth = 32 };
+
+	enum opcode { push_number, push_cell, push_invalid, add, subtract, multiply, divide };
+
+	struct instruction
+	{
+		boost::uint8_t op;
+		boost::uint32_t operand;
+	};
+
+	enum token_kind { left_paren, right_paren, op, number_token, variable_token };
+
+	struct token
+	{
+		token_kind kind;
+		boost::string_ref text;
+	};
+
+	static bool is_letter(char c)
+	{
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+	}
+
+	static bool is_digit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	/*
+	*	Splits the expression into tokens.  Returns false on text that is not a token.
+	*/
+	static bool tokenize(boost::string_ref text, std::vector<token>& tokens)
+	{
+		std::size_t i = 0;
+		while(i < text.size())
+		{
+			char c = text[i];
+			std::size_t start = i;
+			token t;
+			if(std::isspace(static_cast<unsigned char>(c)))
+			{
+				i++;
+				continue;
+			}
+			else if(c == '(' || c == ')')
+			{
+				t.kind = c == '(' ? left_paren : right_paren;
+				i++;
+			}
+			else if(c == '+' || c == '-' || c == '*' || c == '/')
+			{
+				t.kind = op;
+				i++;
+			}
+			else if(is_letter(c))
+			{
+				while(i < text.size() && is_letter(text[i]))
+					i++;
+				if(i == text.size() || !is_digit(text[i]))
+					return false;
+				while(i < text.size() && is_digit(text[i]))
+					i++;
+				t.kind = variable_token;
+			}
+			else if(is_digit(c) || c == '.')
+			{
+				std::size_t digits = 0;
+				for(; i < text.size() && is_digit(text[i]); i++)
+					digits++;
+				if(i < text.size() && text[i] == '.')
+					for(i++; i < text.size() && is_digit(text[i]); i++)
+						digits++;
+				if(digits == 0)
+					return false;
+				//the exponent is only taken when it is complete, like the client's pattern
+				if(i < text.size() && text[i] == 'e')
+				{
+					std::size_t j = i + 1;
+					if(j < text.size() && (text[j] == '+' || text[j] == '-'))
+						j++;
+					if(j < text.size() && is_digit(text[j]))
+					{
+						while(j < text.size() && is_digit(text[j]))
+							j++;
+						i = j;
+					}
+				}
+				t.kind = number_token;
+			}
+			else
+				return false;
+
+			t.text = text.substr(start, i - start);
+			tokens.push_back(t);
+		}
+		return true;
+	}
+
+	/*
+	*	Applies the client's validation rules, in the client's order and with its messages.
+	*/
+	static bool validate(const std::vector<token>& tokens, std::string& error)
+	{
+		if(tokens.empty())
+		{
+			error = "Formula expression cannot be null or empty.";
+			return false;
+		}
+
+		int open = 0;
+		int close = 0;
+		for(std::size_t i = 0; i < tokens.size(); i++)
+		{
+			token_kind kind = tokens[i].kind;
+			bool operand = kind == number_token || kind == variable_token;
+
+			if(i == 0 && !(operand || kind == left_paren))
+			{
+				error = "Formula expression cannot begin with ')', '+', '-', '*' or '/'. It must begin with '(', a variable or a number.";
+				return false;
+			}
+			if(i == tokens.size() - 1 && !(operand || kind == right_paren))
+			{
+				error = "Formula expression cannot end with '(', '+', '-', '*' or '/'. It must end with ')', a variable or a number.";
+				return false;
+			}
+			if(kind == left_paren)
+				open++;
+			if(kind == right_paren)
+				close++;
+			if(close > open)
+			{
+				error = "Formula expression cannot have more closing parantheses than open parantheses at any point in the expression.";
+				return false;
+			}
+			if(i > 0)
+			{
+				token_kind previous = tokens[i - 1].kind;
+				if((previous == left_paren || previous == op) && !(kind == left_paren || operand))
+				{
+					error = "Formula expression must have an opening paranthesis, number or variable following an opening paranthesis or operator.";
+					return false;
+				}
+				if((previous == right_paren || previous == number_token || previous == variable_token) &&
+					!(kind == right_paren || kind == op))
+				{
+					error = "Formula expression must have a closing paranthesis or operator following a closing paranthesis, number or variable.";
+					return false;
+				}
+			}
+		}
+		if(open != close)
+		{
+			error = "Formula expression must contain the same number of opening and closing parantheses.";
+			return false;
+		}
+		return true;
+	}
+
+	static int precedence(char c)
+	{
+		return c == '*' || c == '/' ? 2 : 1;
+	}
+
+	static opcode operation(char c)
+	{
+		switch(c)
+		{
+		case '+': return add;
+		case '-': return subtract;
+		case '*': return multiply;
+		default: return divide;
+		}
+	}
+
+	void emit(opcode code, boost::uint32_t operand, int& depth)
+	{
+		instruction in = { static_cast<boost::uint8_t>(code), operand };
+		code_.push_back(in);
+		depth += (code == push_number || code == push_cell || code == push_invalid) ? 1 : -1;
+		if(depth > max_depth_)
+			max_depth_ = depth;
+	}
+
+	/*
+	*	Converts the validated tokens to postfix code with the shunting-yard algorithm.
+	*/
+	void compile(const std::vector<token>& tokens)
+	{
+		std::vector<char> operators;
+		int depth = 0;
+		max_depth_ = 0;
+		for(std::size_t i = 0; i < tokens.size(); i++)
+		{
+			const token& t = tokens[i];
+			switch(t.kind)
+			{
+			case number_token:
+				numbers_.push_back(std::strtod(t.text.to_string().c_str(), NULL));
+				emit(push_number, numbers_.size() - 1, depth);
+				break;
+			case variable_token:
+			{
+				cell_key key;
+				if(!cell_store::parse_name(t.text, key))
+				{
+					emit(push_invalid, 0, depth);
+					break;
+				}
+				std::size_t index = 0;
+				while(index < references_.size() && references_[index] != key)
+					index++;
+				if(index == references_.size())
+					references_.push_back(key);
+				emit(push_cell, index, depth);
+				break;
+			}
+			case left_paren:
+				operators.push_back('(');
+				break;
+			case right_paren:
+				while(operators.back() != '(')
+				{
+					emit(operation(operators.back()), 0, depth);
+					operators.pop_back();
+				}
+				operators.pop_back();
+				break;
+			case op:
+				//left associative: pop operators of the same or higher precedence
+				while(!operators.empty() && operators.back() != '(' &&
+					precedence(operators.back()) >= precedence(t.text[0]))
+				{
+					emit(operation(operators.back()), 0, depth);
+					operators.pop_back();
+				}
+				operators.push_back(t.text[0]);
+				break;
+			}
+		}
+		while(!operators.empty())
+		{
+			emit(operation(operators.back()), 0, depth);
+			operators.pop_back();
+		}
+	}
+
+	std::vector<instruction> code_;
+	std::vector<double> numbers_;
+	std::vector<cell_key> references_;
+	// The most values on the stack at once while evaluating
+	int max_depth_;
+};
+
+#endif
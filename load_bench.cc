@@ -0,0 +1,180 @@
+//
+// load_bench.cc
+// ~~~~~~~~~~~~~
+//
+// Times loading a spreadsheet file with the property_tree parser, the memory mapped xml
+// scanner and from a sheet file, for sheets of a few sizes, and checks all three load the same
+// cells.  An optional argument limits how many of the sizes run.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include "cell_store.h"
+#include "xml_loader.h"
+#include "sheet_file.h"
+#include "change_journal.h"
+
+/*
+*	Seconds on a monotonic clock.
+*/
+static double now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+*	Writes a sheet of count cells the way the server saves one: numbers, formulas, and text
+*	that needs escaping.
+*/
+static void write_sheet(const std::string& path, std::size_t count)
+{
+	using boost::property_tree::ptree;
+	ptree pt;
+	for(std::size_t i = 0; i < count; i++)
+	{
+		std::ostringstream name, contents;
+		name << static_cast<char>('A' + i % 26) << i / 26 + 1;
+		switch(i % 4)
+		{
+		case 0: contents << i * 0.5; break;
+		case 1: contents << "=A" << i / 26 + 1 << "+" << i; break;
+		case 2: contents << "item <" << i << "> & \"more\""; break;
+		default: contents << "   "; break;
+		}
+		ptree& node = pt.add("spreadsheet.cell", "");
+		node.put("name", name.str());
+		node.put("contents", contents.str());
+	}
+	write_xml(path, pt, std::locale(), boost::property_tree::xml_writer_make_settings<std::string>('\t', 1));
+}
+
+static void load_ptree(const std::string& path, cell_store& cells)
+{
+	using boost::property_tree::ptree;
+	ptree pt;
+	read_xml(path, pt);
+	BOOST_FOREACH(ptree::value_type& v, pt.get_child("spreadsheet"))
+	{
+		std::string name = v.second.get("name", "");
+		std::string value = v.second.get("contents", "");
+		cell_key key;
+		if(value != "" && cell_store::parse_name(name, key))
+			cells.set(cells.intern(key), value);
+	}
+}
+
+static void add_cell(cell_store& cells, boost::string_ref name, boost::string_ref value)
+{
+	cell_key key;
+	if(!value.empty() && cell_store::parse_name(name, key))
+		cells.set(cells.intern(key), value);
+}
+
+static bool load_mapped(const std::string& path, cell_store& cells)
+{
+	mapped_file file;
+	if(!file.open(path))
+		return false;
+	return scan_cells(file.view(), boost::bind(&cell_store::reserve, &cells, _1, _2),
+		boost::bind(add_cell, boost::ref(cells), _1, _2));
+}
+
+static void add_key(cell_store& cells, cell_key key, boost::string_ref value)
+{
+	cells.set(cells.intern(key), value);
+}
+
+static bool load_sheet(const std::string& path, cell_store& cells)
+{
+	mapped_file file;
+	std::string error;
+	return file.open(path) && sheet_file::decode(file.view(), boost::bind(&cell_store::reserve, &cells, _1, _2),
+		boost::bind(add_key, boost::ref(cells), _1, _2), error);
+}
+
+static bool same_cells(cell_store& a, cell_store& b)
+{
+	if(a.size() != b.size())
+		return false;
+	for(cell_store::cell_id id = 0; id < a.id_count(); id++)
+	{
+		cell_store::cell_id other = b.find(a.key(id));
+		boost::string_ref theirs = other == cell_store::npos ? boost::string_ref() : b.contents(other);
+		if(a.contents(id) != theirs)
+			return false;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	const int runs = 3;
+	std::size_t sizes[] = { 1000, 100000, 1000000 };
+	std::size_t size_count = argc > 1 ? std::atoi(argv[1]) : 3;
+	if(size_count < 1 || size_count > 3)
+		size_count = 3;
+
+	std::printf("%10s %12s %12s %12s %12s %12s %9s\n", "cells", "xml bytes", "sheet bytes", "ptree ms",
+		"mapped ms", "sheet ms", "speedup");
+	for(std::size_t s = 0; s < size_count; s++)
+	{
+		std::string path = "load_bench.xml", sheet_path = "load_bench.sheet";
+		write_sheet(path, sizes[s]);
+		mapped_file file;
+		file.open(path);
+		{
+			cell_store cells;
+			load_mapped(path, cells);
+			cells.sort();
+			change_journal::write_file(sheet_path, sheet_file::encode(cells));
+		}
+		mapped_file sheet;
+		sheet.open(sheet_path);
+
+		//best of a few runs, so the first touch of the freshly written file counts for neither
+		double ptree_time = 0, mapped_time = 0, sheet_time = 0;
+		for(int run = 0; run < runs; run++)
+		{
+			cell_store by_ptree, by_mapping, by_sheet;
+			double start = now();
+			load_ptree(path, by_ptree);
+			double elapsed = now() - start;
+			if(run == 0 || elapsed < ptree_time)
+				ptree_time = elapsed;
+
+			start = now();
+			bool mapped = load_mapped(path, by_mapping);
+			elapsed = now() - start;
+			if(run == 0 || elapsed < mapped_time)
+				mapped_time = elapsed;
+
+			start = now();
+			bool loaded = load_sheet(sheet_path, by_sheet);
+			elapsed = now() - start;
+			if(run == 0 || elapsed < sheet_time)
+				sheet_time = elapsed;
+
+			if(!mapped || !loaded || !same_cells(by_ptree, by_mapping) || !same_cells(by_ptree, by_sheet))
+			{
+				std::cout << "The loaders disagree on " << sizes[s] << " cells." << std::endl;
+				return 1;
+			}
+		}
+		std::printf("%10lu %12lu %12lu %12.2f %12.2f %12.2f %8.1fx\n", static_cast<unsigned long>(sizes[s]),
+			static_cast<unsigned long>(file.view().size()), static_cast<unsigned long>(sheet.view().size()),
+			ptree_time * 1000, mapped_time * 1000, sheet_time * 1000, ptree_time / sheet_time);
+	}
+	std::remove("load_bench.xml");
+	std::remove("load_bench.sheet");
+	return 0;
+}
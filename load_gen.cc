@@ -0,0 +1,963 @@
+//
+// load_gen.cc
+// ~~~~~~~~~~~
+//
+// Load generator for the spreadsheet server.  Opens many simulated clients that CREATE and JOIN
+// a set of spreadsheets, then send CHANGE, UNDO and SAVE at a chosen rate and mix over the text
+// protocol.  Every version the server reports is checked, and throughput and latency
+// percentiles are printed at the end.
+//
+// usage: load_gen [key=value ...], see usage() for the keys.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include "message_buffer.h"
+
+using boost::asio::ip::tcp;
+
+/*
+*	Microseconds on a monotonic clock.
+*/
+static boost::uint64_t now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<boost::uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+enum op_kind { op_change, op_undo, op_save, op_count };
+
+static const char* const op_names[op_count] = { "change", "undo", "save" };
+
+/*
+*	Everything a run is set up with.  The same options, seed included, make every client send
+*	the same operations in the same order, so two runs differ only in how the server answers.
+*/
+struct load_options
+{
+	std::string host;
+	std::string port;
+	int clients;
+	int sheets;
+	// Seconds operations are sent for, after every client has joined
+	double duration;
+	// Operations per second per client, 0 sends each as soon as the last is answered
+	double rate;
+	int weights[op_count];
+	// Rows the changes of each client are spread over
+	int rows;
+	int threads;
+	unsigned long seed;
+	std::string prefix;
+	// Seconds to wait for clients to join, and for the last replies once the run is over
+	double setup_timeout;
+	double drain_timeout;
+
+	load_options()
+		: host("127.0.0.1"), port("1984"), clients(1000), sheets(50), duration(10), rate(0),
+		  rows(1000), threads(0), seed(1), prefix("load"), setup_timeout(30), drain_timeout(5)
+	{
+		weights[op_change] = 80;
+		weights[op_undo] = 10;
+		weights[op_save] = 10;
+		unsigned int cores = boost::thread::hardware_concurrency();
+		threads = cores > 1 ? cores / 2 : 1;
+	}
+};
+
+/*
+*	What one client saw.  Latencies are in microseconds.  Each client only touches its own, and
+*	they are added up once the run is over.
+*/
+struct client_stats
+{
+	std::vector<boost::uint32_t> latency[op_count];
+	boost::uint32_t join_latency;
+	bool joined;
+	unsigned long waits, ends, failures, unanswered, updates, violations;
+	std::vector<std::string> violation_notes;
+
+	client_stats()
+		: join_latency(0), joined(false), waits(0), ends(0), failures(0), unanswered(0),
+		  updates(0), violations(0)
+	{
+	}
+};
+
+class load_client;
+
+/*
+*	A run owns the clients and moves them through its phases together:
+*	setup     every client connects, CREATEs its spreadsheet (failing if another client got there
+*	          first is fine) and JOINs it
+*	running   once all have joined, or setup_timeout passes, every client starts sending
+*	          operations for duration seconds
+*	draining  clients LEAVE as soon as their last operation is answered; whatever is still
+*	          outstanding after drain_timeout is counted as unanswered and the sockets are closed
+*/
+class load_run
+{
+public:
+	load_run(boost::asio::io_service& io_service, const load_options& options)
+		: io_service_(io_service), options_(options), strand_(io_service), setup_timer_(io_service),
+		  run_timer_(io_service), settled_(0), finished_(0), began_(false), stopping_(false),
+		  began_at_(0), stopped_at_(0)
+	{
+	}
+
+	/*
+	*	Resolves the server and starts every client connecting.  Returns false if the server
+	*	address does not resolve.
+	*/
+	bool start();
+
+	/*
+	*	Called by each client once it has joined or given up.  The last one begins the run.
+	*/
+	void settled();
+
+	/*
+	*	Called by each client once its connection is closed.  The last one ends the drain.
+	*/
+	void finished();
+
+	bool stopping() const
+	{
+		return stopping_.load(boost::memory_order_acquire);
+	}
+
+	bool began() const
+	{
+		return began_.load(boost::memory_order_acquire);
+	}
+
+	boost::uint64_t began_at() const
+	{
+		return began_at_;
+	}
+
+	const load_options& options() const
+	{
+		return options_;
+	}
+
+	const tcp::endpoint& endpoint() const
+	{
+		return endpoint_;
+	}
+
+	/*
+	*	Prints the results.  Returns the number of version violations seen.
+	*/
+	unsigned long report(std::ostream& out) const;
+
+private:
+	void begin();
+	void stop(const boost::system::error_code& error_code);
+	void close(const boost::system::error_code& error_code);
+	void all_finished();
+
+	boost::asio::io_service& io_service_;
+	const load_options& options_;
+	// The timers are only touched on the strand
+	boost::asio::io_service::strand strand_;
+	tcp::endpoint endpoint_;
+	std::vector<boost::shared_ptr<load_client> > clients_;
+	boost::asio::deadline_timer setup_timer_;
+	boost::asio::deadline_timer run_timer_;
+	boost::atomic<int> settled_;
+	boost::atomic<int> finished_;
+	boost::atomic<bool> began_;
+	boost::atomic<bool> stopping_;
+	// Written once before the clients are told, read by them after
+	boost::uint64_t began_at_;
+	boost::uint64_t stopped_at_;
+};
+
+/*
+*	One simulated user.  It keeps one request outstanding at a time, and checks every message
+*	the server sends it against the protocol:
+*	- every committed version reaches the client exactly once and in order, as an UPDATE or
+*	  UPDATE BATCH for other clients' changes and as the OK of its own, so each must be one more
+*	  than the last it saw
+*	- a WAIT or UNDO END carries the version the client is already at
+*	- a reply answers the request the client sent, and nothing arrives before JOIN OK but the
+*	  answers to CREATE and JOIN
+*	All of a client's handlers run on its strand.
+*/
+class load_client
+  : public boost::enable_shared_from_this<load_client>
+{
+public:
+	typedef boost::shared_ptr<load_client> pointer;
+
+	enum state { connecting, creating, joining, idle, waiting, leaving, finished };
+
+	//JOIN OK carries the whole sheet, so replies may be far larger than what clients send
+	enum { max_reply = 1 << 30 };
+
+	load_client(boost::asio::io_service& io_service, load_run& run, int index)
+		: run_(run), index_(index), strand_(io_service), socket_(io_service), timer_(io_service),
+		  buffer_(max_reply), state_(connecting), writing_(false), version_(0), connected_at_(0), sent_at_(0), next_at_(0),
+		  kind_(op_change), rng_(0)
+	{
+		const load_options& options = run.options();
+		std::ostringstream name;
+		name << options.prefix << "_" << index % options.sheets;
+		sheet_ = name.str();
+		//clients of one sheet change different columns, so most changes can be rebased
+		column_ = static_cast<char>('A' + (index / options.sheets) % 26);
+		rng_ = (options.seed + 1) * 0x9E3779B97F4A7C15ull ^ (index + 1) * 0xBF58476D1CE4E5B9ull;
+		if(rng_ == 0)
+			rng_ = 1;
+		if(options.rate > 0)
+			interval_ = static_cast<boost::uint64_t>(1e6 / options.rate);
+		else
+			interval_ = 0;
+	}
+
+	void start()
+	{
+		connected_at_ = now();
+		socket_.async_connect(run_.endpoint(),
+			strand_.wrap(boost::bind(&load_client::handle_connect, shared_from_this(),
+				boost::asio::placeholders::error)));
+	}
+
+	/*
+	*	Starts sending operations.  A client that joins after the run began starts straight away.
+	*/
+	void begin()
+	{
+		strand_.dispatch(boost::bind(&load_client::do_begin, shared_from_this()));
+	}
+
+	/*
+	*	Leaves once the outstanding operation, if any, is answered.
+	*/
+	void stop()
+	{
+		strand_.dispatch(boost::bind(&load_client::do_stop, shared_from_this()));
+	}
+
+	/*
+	*	Closes the connection whatever state it is in.
+	*/
+	void close()
+	{
+		strand_.dispatch(boost::bind(&load_client::do_close, shared_from_this()));
+	}
+
+	const client_stats& stats() const
+	{
+		return stats_;
+	}
+
+private:
+	void handle_connect(const boost::system::error_code& error_code)
+	{
+		if(error_code)
+		{
+			give_up("connect failed: " + error_code.message());
+			return;
+		}
+		boost::system::error_code ignored;
+		socket_.set_option(tcp::no_delay(true), ignored);
+		read();
+
+		state_ = creating;
+		send("CREATE\nName:" + sheet_ + "\nPassword:" + run_.options().prefix + "\n");
+	}
+
+	void read()
+	{
+		socket_.async_receive(buffer_.prepare(),
+			strand_.wrap(boost::bind(&load_client::handle_read, shared_from_this(),
+				boost::asio::placeholders::error,
+				boost::asio::placeholders::bytes_transferred)));
+	}
+
+	void handle_read(const boost::system::error_code& error_code, std::size_t bytes_transferred)
+	{
+		if(state_ == finished)
+			return;
+		if(error_code)
+		{
+			if(state_ == leaving)
+				finish();
+			else
+				give_up("connection lost: " + error_code.message());
+			return;
+		}
+
+		buffer_.commit(bytes_transferred);
+		message msg;
+		while(state_ != finished && buffer_.next(msg))
+			received(msg);
+		if(state_ != finished && buffer_.failed())
+			give_up("reply larger than the message buffer");
+		if(state_ != finished)
+			read();
+	}
+
+	void received(const message& msg)
+	{
+		if(msg.command == "UPDATE" || msg.command == "UPDATE BATCH")
+		{
+			if(state_ < idle)
+				violation("UPDATE before JOIN OK");
+			else if(msg.get("Name") != sheet_)
+				violation("UPDATE for " + msg.get("Name").to_string());
+			else
+				committed(msg, "UPDATE");
+			stats_.updates++;
+			return;
+		}
+
+		switch(state_)
+		{
+		case creating:
+			if(msg.command != "CREATE OK" && msg.command != "CREATE FAIL")
+			{
+				unexpected(msg);
+				return;
+			}
+			state_ = joining;
+			send("JOIN\nName:" + sheet_ + "\nPassword:" + run_.options().prefix + "\n");
+			break;
+
+		case joining:
+			if(msg.command != "JOIN OK")
+			{
+				give_up("JOIN failed: " + msg.raw.to_string());
+				return;
+			}
+			version_ = msg.get_int("Version", -1);
+			stats_.joined = true;
+			stats_.join_latency = now() - connected_at_;
+			state_ = idle;
+			run_.settled();
+			if(run_.began())
+				do_begin();
+			break;
+
+		case waiting:
+			answered(msg);
+			break;
+
+		case leaving:
+			//answers to the last operation and saves may still arrive
+			break;
+
+		default:
+			unexpected(msg);
+			break;
+		}
+	}
+
+	/*
+	*	Checks the reply to the outstanding operation.
+	*/
+	void answered(const message& msg)
+	{
+		boost::string_ref command = msg.command;
+		bool matched = true;
+		switch(kind_)
+		{
+		case op_change:
+			if(command == "CHANGE OK")
+				committed(msg, "CHANGE OK");
+			else if(command == "CHANGE WAIT")
+				waited(msg, stats_.waits);
+			else if(command == "CHANGE FAIL")
+				stats_.failures++;
+			else
+				matched = false;
+			break;
+
+		case op_undo:
+			if(command == "UNDO OK" || command == "UNDO BATCH OK")
+				committed(msg, "UNDO OK");
+			else if(command == "UNDO WAIT")
+				waited(msg, stats_.waits);
+			else if(command == "UNDO END")
+				waited(msg, stats_.ends);
+			else if(command == "UNDO FAIL")
+				stats_.failures++;
+			else
+				matched = false;
+			break;
+
+		default:
+			if(command == "SAVE FAIL")
+				stats_.failures++;
+			else if(command != "SAVE OK")
+				matched = false;
+			break;
+		}
+		if(!matched)
+		{
+			unexpected(msg);
+			return;
+		}
+
+		//operations answered after the run are not part of it
+		boost::uint64_t answered_at = now();
+		if(!run_.stopping())
+			stats_.latency[kind_].push_back(static_cast<boost::uint32_t>(std::min<boost::uint64_t>(answered_at - sent_at_, 0xffffffffu)));
+		state_ = idle;
+		schedule(answered_at);
+	}
+
+	void committed(const message& msg, const char* what)
+	{
+		int version = msg.get_int("Version", -1);
+		if(version != version_ + 1)
+		{
+			std::ostringstream note;
+			note << what << " version " << version << " after version " << version_;
+			violation(note.str());
+		}
+		if(version > version_)
+			version_ = version;
+	}
+
+	void waited(const message& msg, unsigned long& count)
+	{
+		count++;
+		int version = msg.get_int("Version", -1);
+		if(version != version_)
+		{
+			std::ostringstream note;
+			note << msg.command << " version " << version << " at version " << version_;
+			violation(note.str());
+		}
+	}
+
+	void do_begin()
+	{
+		if(state_ != idle || next_at_ != 0)
+			return;
+		//spread the first operations over one interval so paced clients do not send in step
+		boost::uint64_t start = std::max(run_.began_at(), now());
+		schedule(start + (interval_ > 0 ? next_random() % interval_ : 0));
+	}
+
+	/*
+	*	Sends the next operation at its scheduled time.  Paced clients keep to a fixed schedule:
+	*	an operation that could not be sent on time because the last was slow is sent at once, and
+	*	its latency still counts from when it should have been sent, so a stalled server shows up
+	*	in the percentiles instead of just slowing the client down.
+	*/
+	void schedule(boost::uint64_t at)
+	{
+		if(run_.stopping())
+		{
+			leave();
+			return;
+		}
+		if(next_at_ == 0 || interval_ == 0)
+			next_at_ = at;
+		else
+			next_at_ += interval_;
+
+		boost::uint64_t current = now();
+		if(next_at_ <= current)
+		{
+			send_operation();
+			return;
+		}
+		timer_.expires_from_now(boost::posix_time::microseconds(next_at_ - current));
+		timer_.async_wait(strand_.wrap(boost::bind(&load_client::handle_timer, shared_from_this(),
+			boost::asio::placeholders::error)));
+	}
+
+	void handle_timer(const boost::system::error_code& error_code)
+	{
+		if(error_code || state_ != idle)
+			return;
+		if(run_.stopping())
+			leave();
+		else
+			send_operation();
+	}
+
+	void send_operation()
+	{
+		const load_options& options = run_.options();
+		int total = options.weights[op_change] + options.weights[op_undo] + options.weights[op_save];
+		int pick = next_random() % total;
+		kind_ = op_change;
+		while(pick >= options.weights[kind_])
+		{
+			pick -= options.weights[kind_];
+			kind_ = static_cast<op_kind>(kind_ + 1);
+		}
+
+		std::ostringstream out;
+		switch(kind_)
+		{
+		case op_change:
+		{
+			std::ostringstream contents;
+			contents << next_random() % 100000;
+			out << "CHANGE\nName:" << sheet_ << "\nVersion:" << version_
+				<< "\nCell:" << column_ << next_random() % options.rows + 1
+				<< "\nLength:" << contents.str().size() << "\n" << contents.str() << "\n";
+			break;
+		}
+		case op_undo:
+			out << "UNDO\nName:" << sheet_ << "\nVersion:" << version_ << "\n";
+			break;
+		default:
+			out << "SAVE\nName:" << sheet_ << "\n";
+			break;
+		}
+
+		sent_at_ = interval_ > 0 ? next_at_ : now();
+		state_ = waiting;
+		send(out.str());
+	}
+
+	void do_stop()
+	{
+		if(state_ == idle)
+		{
+			timer_.cancel();
+			leave();
+		}
+	}
+
+	void leave()
+	{
+		state_ = leaving;
+		send("LEAVE\nName:" + sheet_ + "\n");
+	}
+
+	void do_close()
+	{
+		if(state_ == finished)
+			return;
+		if(state_ == waiting)
+			stats_.unanswered++;
+		else if(state_ < idle)
+			note("gave up waiting to join");
+		finish();
+	}
+
+	/*
+	*	Queues a message.  Only LEAVE can be sent while a request is still being written.
+	*/
+	void send(const std::string& data)
+	{
+		pending_.push_back(data);
+		if(!writing_)
+			write();
+	}
+
+	void write()
+	{
+		writing_ = true;
+		boost::asio::async_write(socket_, boost::asio::buffer(pending_.front()),
+			strand_.wrap(boost::bind(&load_client::handle_write, shared_from_this(),
+				boost::asio::placeholders::error)));
+	}
+
+	void handle_write(const boost::system::error_code& error_code)
+	{
+		writing_ = false;
+		pending_.pop_front();
+		if(state_ == finished)
+			return;
+		if(error_code)
+		{
+			if(state_ == leaving)
+				finish();
+			else
+				give_up("write failed: " + error_code.message());
+			return;
+		}
+		if(!pending_.empty())
+			write();
+		else if(state_ == leaving)
+			finish();
+	}
+
+	/*
+	*	The client could not join or lost its connection before the run was over.
+	*/
+	void give_up(const std::string& reason)
+	{
+		state was = state_;
+		note(reason);
+		if(was == waiting)
+			stats_.unanswered++;
+		finish();
+		if(was < idle)
+			run_.settled();
+	}
+
+	void finish()
+	{
+		if(state_ == finished)
+			return;
+		state_ = finished;
+		run_.finished();
+		timer_.cancel();
+		boost::system::error_code ignored;
+		socket_.shutdown(tcp::socket::shutdown_both, ignored);
+		socket_.close(ignored);
+	}
+
+	void unexpected(const message& msg)
+	{
+		std::ostringstream text;
+		text << "unexpected " << msg.command << " in state " << state_;
+		violation(text.str());
+	}
+
+	void violation(const std::string& text)
+	{
+		stats_.violations++;
+		note(text);
+	}
+
+	void note(const std::string& text)
+	{
+		if(stats_.violation_notes.size() < 4)
+			stats_.violation_notes.push_back(sheet_ + " client " + boost::lexical_cast<std::string>(index_) + ": " + text);
+	}
+
+	/*
+	*	xorshift64*, one stream per client.
+	*/
+	boost::uint64_t next_random()
+	{
+		rng_ ^= rng_ >> 12;
+		rng_ ^= rng_ << 25;
+		rng_ ^= rng_ >> 27;
+		return rng_ * 0x2545F4914F6CDD1Dull;
+	}
+
+	load_run& run_;
+	int index_;
+	boost::asio::io_service::strand strand_;
+	tcp::socket socket_;
+	boost::asio::deadline_timer timer_;
+	message_buffer buffer_;
+	std::deque<std::string> pending_;
+	state state_;
+	bool writing_;
+	std::string sheet_;
+	char column_;
+	// The last version this client saw committed
+	int version_;
+	boost::uint64_t connected_at_;
+	// When the outstanding operation was, or should have been, sent
+	boost::uint64_t sent_at_;
+	// When the next operation is due, 0 before the first
+	boost::uint64_t next_at_;
+	boost::uint64_t interval_;
+	op_kind kind_;
+	boost::uint64_t rng_;
+	client_stats stats_;
+};
+
+bool load_run::start()
+{
+	boost::system::error_code error_code;
+	tcp::resolver resolver(io_service_);
+	tcp::resolver::iterator it = resolver.resolve(tcp::resolver::query(options_.host, options_.port), error_code);
+	if(error_code || it == tcp::resolver::iterator())
+		return false;
+	endpoint_ = *it;
+
+	for(int i = 0; i < options_.clients; i++)
+		clients_.push_back(boost::make_shared<load_client>(boost::ref(io_service_), boost::ref(*this), i));
+	for(std::size_t i = 0; i < clients_.size(); i++)
+		clients_[i]->start();
+
+	setup_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(options_.setup_timeout * 1000)));
+	setup_timer_.async_wait(strand_.wrap(boost::bind(&load_run::begin, this)));
+	return true;
+}
+
+void load_run::settled()
+{
+	if(++settled_ == options_.clients)
+		strand_.post(boost::bind(&load_run::begin, this));
+}
+
+void load_run::finished()
+{
+	if(++finished_ == options_.clients)
+		strand_.post(boost::bind(&load_run::all_finished, this));
+}
+
+void load_run::all_finished()
+{
+	setup_timer_.cancel();
+	run_timer_.cancel();
+}
+
+void load_run::begin()
+{
+	if(began_ || finished_ == options_.clients)
+		return;
+	setup_timer_.cancel();
+	began_at_ = now();
+	began_.store(true, boost::memory_order_release);
+	std::cerr << "All clients settled, running for " << options_.duration << " s" << std::endl;
+	for(std::size_t i = 0; i < clients_.size(); i++)
+		clients_[i]->begin();
+
+	run_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(options_.duration * 1000)));
+	run_timer_.async_wait(strand_.wrap(boost::bind(&load_run::stop, this, boost::asio::placeholders::error)));
+}
+
+void load_run::stop(const boost::system::error_code& error_code)
+{
+	if(error_code)
+		return;
+	stopped_at_ = now();
+	stopping_.store(true, boost::memory_order_release);
+	for(std::size_t i = 0; i < clients_.size(); i++)
+		clients_[i]->stop();
+
+	run_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(options_.drain_timeout * 1000)));
+	run_timer_.async_wait(strand_.wrap(boost::bind(&load_run::close, this, boost::asio::placeholders::error)));
+}
+
+void load_run::close(const boost::system::error_code& error_code)
+{
+	if(error_code)
+		return;
+	for(std::size_t i = 0; i < clients_.size(); i++)
+		clients_[i]->close();
+}
+
+/*
+*	The latency at quantile q of sorted, in milliseconds.
+*/
+static double percentile(const std::vector<boost::uint32_t>& sorted, double q)
+{
+	if(sorted.empty())
+		return 0;
+	std::size_t rank = static_cast<std::size_t>(q * sorted.size());
+	if(rank >= sorted.size())
+		rank = sorted.size() - 1;
+	return sorted[rank] / 1000.0;
+}
+
+static void print_row(std::ostream& out, const char* name, std::vector<boost::uint32_t>& latencies, double seconds)
+{
+	std::sort(latencies.begin(), latencies.end());
+	char line[160];
+	std::snprintf(line, sizeof(line), "%-10s %10lu %12.1f %10.3f %10.3f %10.3f %10.3f",
+		name, static_cast<unsigned long>(latencies.size()), seconds > 0 ? latencies.size() / seconds : 0,
+		percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+		latencies.empty() ? 0 : latencies.back() / 1000.0);
+	out << line << std::endl;
+}
+
+unsigned long load_run::report(std::ostream& out) const
+{
+	std::vector<boost::uint32_t> latencies[op_count], all, joins;
+	client_stats total;
+	std::vector<std::string> notes;
+	int joined = 0;
+	for(std::size_t i = 0; i < clients_.size(); i++)
+	{
+		const client_stats& stats = clients_[i]->stats();
+		for(int kind = 0; kind < op_count; kind++)
+		{
+			latencies[kind].insert(latencies[kind].end(), stats.latency[kind].begin(), stats.latency[kind].end());
+			all.insert(all.end(), stats.latency[kind].begin(), stats.latency[kind].end());
+		}
+		if(stats.joined)
+		{
+			joined++;
+			joins.push_back(stats.join_latency);
+		}
+		total.waits += stats.waits;
+		total.ends += stats.ends;
+		total.failures += stats.failures;
+		total.unanswered += stats.unanswered;
+		total.updates += stats.updates;
+		total.violations += stats.violations;
+		for(std::size_t j = 0; j < stats.violation_notes.size() && notes.size() < 20; j++)
+			notes.push_back(stats.violation_notes[j]);
+	}
+
+	double seconds = began_at_ > 0 && stopped_at_ > began_at_ ? (stopped_at_ - began_at_) / 1e6 : 0;
+	std::sort(joins.begin(), joins.end());
+	out << "clients " << options_.clients << ", sheets " << options_.sheets << ", seed " << options_.seed
+		<< ", rate " << (options_.rate > 0 ? boost::lexical_cast<std::string>(options_.rate) + "/s per client" : "closed loop")
+		<< ", mix change:" << options_.weights[op_change] << " undo:" << options_.weights[op_undo]
+		<< " save:" << options_.weights[op_save] << std::endl;
+	out << "joined " << joined << " of " << options_.clients << ", join p50 " << percentile(joins, 0.5)
+		<< " ms, p99 " << percentile(joins, 0.99) << " ms" << std::endl;
+	out << "ran " << seconds << " s" << std::endl;
+	out << "operation       count        ops/s     p50 ms     p99 ms    p999 ms     max ms" << std::endl;
+	for(int kind = 0; kind < op_count; kind++)
+		print_row(out, op_names[kind], latencies[kind], seconds);
+	print_row(out, "all", all, seconds);
+	out << "waits " << total.waits << ", undo ends " << total.ends << ", failures " << total.failures
+		<< ", unanswered " << total.unanswered << std::endl;
+	out << "updates received " << total.updates << " (" << (seconds > 0 ? static_cast<unsigned long>(total.updates / seconds) : 0)
+		<< "/s)" << std::endl;
+	out << "version violations " << total.violations << std::endl;
+	for(std::size_t i = 0; i < notes.size(); i++)
+		out << "  " << notes[i] << std::endl;
+	return total.violations + (joined == 0 ? 1 : 0);
+}
+
+static void usage()
+{
+	std::cerr << "usage: load_gen [key=value ...]\n"
+		"  host=127.0.0.1     server address\n"
+		"  port=1984          server port\n"
+		"  clients=1000       simulated clients\n"
+		"  sheets=50          spreadsheets the clients are spread over\n"
+		"  duration=10        seconds to send operations for\n"
+		"  rate=0             operations per second per client, 0 for as fast as answered\n"
+		"  mix=change:80,undo:10,save:10\n"
+		"                     relative weights of the operations\n"
+		"  rows=1000          rows each client's changes are spread over\n"
+		"  threads=cores/2    io threads\n"
+		"  seed=1             seed for the operations each client sends\n"
+		"  prefix=load        spreadsheet names are prefix_n, the password is prefix\n"
+		"  setup=30           seconds to wait for every client to join\n"
+		"  drain=5            seconds to wait for the last replies\n";
+}
+
+static bool parse_mix(const std::string& value, load_options& options)
+{
+	int weights[op_count] = { 0, 0, 0 };
+	std::istringstream in(value);
+	std::string item;
+	while(std::getline(in, item, ','))
+	{
+		std::string::size_type colon = item.find(':');
+		if(colon == std::string::npos)
+			return false;
+		std::string name = item.substr(0, colon);
+		int kind = 0;
+		while(kind < op_count && name != op_names[kind])
+			kind++;
+		if(kind == op_count)
+			return false;
+		weights[kind] = std::atoi(item.c_str() + colon + 1);
+		if(weights[kind] < 0)
+			return false;
+	}
+	if(weights[op_change] + weights[op_undo] + weights[op_save] <= 0)
+		return false;
+	std::copy(weights, weights + op_count, options.weights);
+	return true;
+}
+
+static bool parse_options(int argc, char* argv[], load_options& options)
+{
+	for(int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		std::string::size_type equals = arg.find('=');
+		if(equals == std::string::npos)
+			return false;
+		std::string key = arg.substr(0, equals);
+		std::string value = arg.substr(equals + 1);
+		if(key == "host")
+			options.host = value;
+		else if(key == "port")
+			options.port = value;
+		else if(key == "clients")
+			options.clients = std::atoi(value.c_str());
+		else if(key == "sheets")
+			options.sheets = std::atoi(value.c_str());
+		else if(key == "duration")
+			options.duration = std::atof(value.c_str());
+		else if(key == "rate")
+			options.rate = std::atof(value.c_str());
+		else if(key == "mix")
+		{
+			if(!parse_mix(value, options))
+				return false;
+		}
+		else if(key == "rows")
+			options.rows = std::atoi(value.c_str());
+		else if(key == "threads")
+			options.threads = std::atoi(value.c_str());
+		else if(key == "seed")
+			options.seed = std::strtoul(value.c_str(), NULL, 10);
+		else if(key == "prefix")
+			options.prefix = value;
+		else if(key == "setup")
+			options.setup_timeout = std::atof(value.c_str());
+		else if(key == "drain")
+			options.drain_timeout = std::atof(value.c_str());
+		else
+			return false;
+	}
+	return options.clients > 0 && options.sheets > 0 && options.duration > 0 && options.rate >= 0 &&
+		options.rows > 0 && options.threads > 0;
+}
+
+int main(int argc, char* argv[])
+{
+	load_options options;
+	if(!parse_options(argc, argv, options))
+	{
+		usage();
+		return 2;
+	}
+
+	//every client is a socket
+	rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+	{
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+
+	try
+	{
+		boost::asio::io_service io_service;
+		load_run run(io_service, options);
+		if(!run.start())
+		{
+			std::cerr << "Could not resolve " << options.host << ":" << options.port << std::endl;
+			return 2;
+		}
+
+		boost::thread_group pool;
+		for(int i = 0; i < options.threads; i++)
+			pool.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+		pool.join_all();
+
+		return run.report(std::cout) == 0 ? 0 : 1;
+	}
+	catch(std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+}
@@ -0,0 +1,382 @@
+//
+// message_buffer.h
+// ~~~~~~~~~~~~~~~~
+//
+// Per-connection receive buffer and incremental parser for the spreadsheet
+// text protocol.
+//
+
+#ifndef MESSAGE_BUFFER_H
+#define MESSAGE_BUFFER_H
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/*
+*	A message is one complete protocol message sitting in a message_buffer.  Every field is a
+*	view into the buffer, so a message is only valid until the buffer is read into again.
+*
+*	command is the first line (for example "CHANGE" or "JOIN OK").  Each header line after it
+*	is split on the first ':' into a key and a value; lines without a ':' (the reason line of a
+*	FAIL message) get an empty key.  body holds the Length: bytes for the messages that carry
+*	one, and is empty otherwise.
+*/
+struct message
+{
+	enum { max_fields = 8 };
+
+	struct field
+	{
+		boost::string_ref key;
+		boost::string_ref value;
+	};
+
+	boost::string_ref command;
+	field fields[max_fields];
+	int field_count;
+	boost::string_ref body;
+	boost::string_ref raw;
+
+	/*
+	*	Returns the value of the first header with the given key, or an empty view.
+	*/
+	boost::string_ref get(boost::string_ref key) const
+	{
+		for(int i = 0; i < field_count; i++)
+			if(fields[i].key == key)
+				return fields[i].value;
+		return boost::string_ref();
+	}
+
+	/*
+	*	Returns the value of the given header parsed as an integer, or fallback if it is missing,
+	*	is not all digits after an optional '-', or does not fit in an int.
+	*/
+	int get_int(boost::string_ref key, int fallback = 0) const
+	{
+		boost::string_ref value = get(key);
+		if(value.empty())
+			return fallback;
+		int result = 0;
+		bool negative = false;
+		std::size_t i = 0;
+		if(value[0] == '-')
+		{
+			negative = true;
+			i++;
+		}
+		if(i == value.size())
+			return fallback;
+		for(; i < value.size(); i++)
+		{
+			if(value[i] < '0' || value[i] > '9')
+				return fallback;
+			int digit = value[i] - '0';
+			if(result > (INT_MAX - digit) / 10)
+				return fallback;
+			result = result * 10 + digit;
+		}
+		return negative ? -result : result;
+	}
+};
+
+/*
+*	The framing of each command: how many header lines follow the command line, and whether
+*	the last of them is a Length: header followed by that many bytes of content and a newline.
+*	Covers both the messages clients send and the ones the server sends back.
+*/
+struct message_format
+{
+	const char* command;
+	int header_lines;
+	bool has_body;
+};
+
+static const message_format message_formats[] =
+{
+	//client to server
+	{ "CREATE", 2, false },
+	{ "JOIN", 2, false },
+	{ "CHANGE", 4, true },
+	{ "UNDO", 2, false },
+	{ "SAVE", 1, false },
+	{ "LEAVE", 1, false },
+	{ "VALUE", 2, false },
+	{ "RANGE", 3, false },
+	{ "BATCH CHANGE", 4, true },
+	//server to client
+	{ "CREATE OK", 2, false },
+	{ "CREATE FAIL", 2, false },
+	{ "JOIN OK", 3, true },
+	{ "JOIN FAIL", 2, false },
+	{ "CHANGE OK", 2, false },
+	{ "CHANGE WAIT", 2, false },
+	{ "CHANGE FAIL", 2, false },
+	{ "UNDO OK", 4, true },
+	{ "UNDO END", 2, false },
+	{ "UNDO WAIT", 2, false },
+	{ "UNDO FAIL", 2, false },
+	{ "UPDATE", 4, true },
+	{ "SAVE OK", 1, false },
+	{ "SAVE FAIL", 2, false },
+	{ "VALUE OK", 4, true },
+	{ "VALUE FAIL", 2, false },
+	{ "RANGE OK", 5, true },
+	{ "RANGE FAIL", 2, false },
+	{ "BATCH CHANGE OK", 2, false },
+	{ "BATCH CHANGE WAIT", 2, false },
+	{ "BATCH CHANGE FAIL", 2, false },
+	{ "UNDO BATCH OK", 4, true },
+	{ "UPDATE BATCH", 4, true },
+	{ "ERROR", 0, false },
+};
+
+/*
+*	The body of a BATCH CHANGE, UPDATE BATCH or UNDO BATCH OK is a run of cell changes, each
+*	framed like the end of a CHANGE:
+*	Cell:cell
+*	Length:length
+*	content
+*
+*	next_batch_entry() takes the next change off the front of body and returns false if it is
+*	malformed; append_batch_entry() adds one change to a body being built.
+*/
+inline bool next_batch_entry(boost::string_ref& body, boost::string_ref& cell, boost::string_ref& contents)
+{
+	std::size_t newline = body.find('\n');
+	if(newline == boost::string_ref::npos || !body.starts_with("Cell:"))
+		return false;
+	cell = body.substr(5, newline - 5);
+	if(!cell.empty() && cell[cell.size() - 1] == '\r')
+		cell.remove_suffix(1);
+	body.remove_prefix(newline + 1);
+
+	newline = body.find('\n');
+	if(newline == boost::string_ref::npos || !body.starts_with("Length:"))
+		return false;
+	std::size_t length = 0;
+	std::size_t i = 7;
+	for(; i < newline && body[i] >= '0' && body[i] <= '9'; i++)
+		length = length * 10 + (body[i] - '0');
+	if(i == 7 || (i != newline && !(i + 1 == newline && body[i] == '\r')))
+		return false;
+	body.remove_prefix(newline + 1);
+
+	//the content is followed by a newline
+	if(body.size() < length + 1)
+		return false;
+	contents = body.substr(0, length);
+	body.remove_prefix(length);
+	if(body[0] == '\r' && body.size() > 1)
+		body.remove_prefix(1);
+	if(body[0] != '\n')
+		return false;
+	body.remove_prefix(1);
+	return true;
+}
+
+inline void append_batch_entry(std::string& body, boost::string_ref cell, boost::string_ref contents)
+{
+	char length[24];
+	std::snprintf(length, sizeof(length), "%lu", static_cast<unsigned long>(contents.size()));
+	body.append("Cell:").append(cell.data(), cell.size());
+	body.append("\nLength:").append(length).append("\n");
+	body.append(contents.data(), contents.size()).append("\n");
+}
+
+/*
+*	The message_buffer owns the bytes received on one connection.  Reads go into the free space
+*	at the back of the buffer and complete messages are taken off the front, so any number of
+*	messages can come out of one read and a partial message simply waits for the next one.
+*
+*	The storage is reused for the life of the connection: consumed bytes are reclaimed by moving
+*	the unread tail back to the front, and the storage only grows when a single message is bigger
+*	than everything that is free.  Messages are handed out as views, so parsing does not allocate.
+*
+*	A message may be at most max_message bytes.  Once the peer sends a Length: past that or
+*	that is not a number, or that many bytes without finishing a message, the buffer has failed
+*	and takes no more messages, so one peer cannot make it grow without bound.
+*/
+class message_buffer
+{
+public:
+	enum { initial_size = 4096, min_read = 1024, default_max_message = 16 << 20 };
+
+	explicit message_buffer(std::size_t max_message = default_max_message)
+		: storage_(initial_size), begin_(0), end_(0), max_message_(max_message), failed_(false)
+	{
+	}
+
+	/*
+	*	Returns the free space to receive into.  Invalidates any message taken from the buffer.
+	*/
+	boost::asio::mutable_buffers_1 prepare()
+	{
+		if(storage_.size() - end_ < min_read)
+		{
+			//reclaim the consumed front of the buffer
+			if(begin_ > 0)
+			{
+				std::memmove(&storage_[0], &storage_[begin_], end_ - begin_);
+				end_ -= begin_;
+				begin_ = 0;
+			}
+			//one message is larger than the whole buffer
+			if(storage_.size() - end_ < min_read)
+				storage_.resize(storage_.size() * 2);
+		}
+		return boost::asio::buffer(&storage_[end_], storage_.size() - end_);
+	}
+
+	/*
+	*	Marks bytes_transferred bytes of the prepared space as received.
+	*/
+	void commit(std::size_t bytes_transferred)
+	{
+		end_ += bytes_transferred;
+	}
+
+	/*
+	*	Takes the next complete message off the front of the buffer.  Returns false, leaving the
+	*	partial message in place, when the buffer does not hold a whole message yet or has failed.
+	*/
+	bool next(message& msg)
+	{
+		const char* data = &storage_[0] + begin_;
+		std::size_t size = end_ - begin_;
+		std::size_t pos = 0;
+
+		if(failed_)
+			return false;
+		if(!read_line(data, size, pos, msg.command))
+			return incomplete(size);
+
+		const message_format* format = find_format(msg.command);
+		int header_lines = format ? format->header_lines : 0;
+
+		msg.field_count = 0;
+		msg.body = boost::string_ref();
+		for(int i = 0; i < header_lines; i++)
+		{
+			boost::string_ref line;
+			if(!read_line(data, size, pos, line))
+				return incomplete(size);
+			if(msg.field_count < message::max_fields)
+				split_field(line, msg.fields[msg.field_count++]);
+		}
+
+		if(format && format->has_body)
+		{
+			//a missing Length: is an empty body, one that is not a number, is negative or is too big
+			//fails the buffer
+			int length_field = msg.get_int("Length", -1);
+			if(length_field < 0 && !msg.get("Length").empty())
+				length_field = INT_MAX;
+			std::size_t length = length_field > 0 ? length_field : 0;
+			if(length > max_message_)
+			{
+				failed_ = true;
+				return false;
+			}
+			//the content is followed by a newline
+			if(size - pos < length + 1)
+				return incomplete(size);
+			msg.body = boost::string_ref(data + pos, length);
+			pos += length;
+			if(data[pos] == '\r')
+			{
+				if(pos + 1 == size)
+					return incomplete(size);
+				if(data[pos + 1] == '\n')
+					pos++;
+			}
+			if(data[pos] == '\n')
+				pos++;
+		}
+
+		msg.raw = boost::string_ref(data, pos);
+		begin_ += pos;
+		if(begin_ == end_)
+			begin_ = end_ = 0;
+		return true;
+	}
+
+	/*
+	*	Returns the number of received bytes not yet taken as messages.
+	*/
+	std::size_t pending() const
+	{
+		return end_ - begin_;
+	}
+
+	/*
+	*	True once the peer has sent a message larger than max_message.
+	*/
+	bool failed() const
+	{
+		return failed_;
+	}
+
+private:
+	/*
+	*	The buffer holds size bytes of a message that is not complete yet.  Fails the buffer if
+	*	that is already more than a message may be.
+	*/
+	bool incomplete(std::size_t size)
+	{
+		if(size > max_message_)
+			failed_ = true;
+		return false;
+	}
+
+	static const message_format* find_format(boost::string_ref command)
+	{
+		for(std::size_t i = 0; i < sizeof(message_formats) / sizeof(message_formats[0]); i++)
+			if(command == message_formats[i].command)
+				return &message_formats[i];
+		return NULL;
+	}
+
+	/*
+	*	Reads the line starting at pos, without its line ending, and moves pos past it.
+	*/
+	static bool read_line(const char* data, std::size_t size, std::size_t& pos, boost::string_ref& line)
+	{
+		const char* start = data + pos;
+		const char* newline = static_cast<const char*>(std::memchr(start, '\n', size - pos));
+		if(newline == NULL)
+			return false;
+		std::size_t length = newline - start;
+		pos += length + 1;
+		if(length > 0 && start[length - 1] == '\r')
+			length--;
+		line = boost::string_ref(start, length);
+		return true;
+	}
+
+	static void split_field(boost::string_ref line, message::field& field)
+	{
+		std::size_t colon = line.find(':');
+		if(colon == boost::string_ref::npos)
+		{
+			field.key = boost::string_ref();
+			field.value = line;
+			return;
+		}
+		field.key = line.substr(0, colon);
+		field.value = line.substr(colon + 1);
+	}
+
+	std::vector<char> storage_;
+	std::size_t begin_;
+	std::size_t end_;
+	std::size_t max_message_;
+	bool failed_;
+};
+
+#endif
@@ -0,0 +1,475 @@
+//
+// metrics.h
+// ~~~~~~~~~
+//
+// Counters, latency histograms and per-session gauges, served in the Prometheus text format.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <istream>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+/*
+*	Gauges of one session.  The session stores them as it changes and a scrape reads them from
+*	another thread, so they are atomics; nothing else about the session is read by a scrape.
+*/
+struct session_gauges
+{
+	explicit session_gauges(const std::string& name)
+		: name(name), users(0), undo_depth(0), cells(0), memory(0)
+	{
+	}
+
+	const std::string name;
+	boost::atomic<long> users;
+	boost::atomic<long> undo_depth;
+	boost::atomic<long> cells;
+	boost::atomic<long> memory;
+};
+
+/*
+*	The server_metrics count events and time the key paths of the server.
+*
+*	Every thread that records anything gets its own shard of counters and histograms, which only
+*	that thread writes, so recording is a plain load and store of a relaxed atomic: no lock and
+*	no shared cache line.  A scrape sums the shards.
+*
+*	Histograms are HDR style: each power of two of microseconds is split into sub_buckets linear
+*	buckets, so every recorded latency is kept to within 1/sub_buckets of its value from a
+*	microsecond up to days, in a fixed number of buckets.  Quantiles are reported as the upper
+*	end of the bucket they fall in.
+*/
+class server_metrics
+{
+public:
+	enum counter
+	{
+		connections_accepted, joins, changes_committed, changes_waited, batch_changes_committed,
+		undos, saves, save_failures, updates_sent, sessions_loaded, sessions_unloaded, counter_count
+	};
+
+	enum histogram
+	{
+		accept_latency, join_latency, current_state_latency, change_latency, update_latency,
+		undo_latency, save_latency, load_latency, histogram_count
+	};
+
+	static server_metrics& instance()
+	{
+		static server_metrics metrics;
+		return metrics;
+	}
+
+	/*
+	*	Microseconds on a monotonic clock.
+	*/
+	static boost::uint64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+	}
+
+	void add(counter c, boost::uint64_t n = 1)
+	{
+		bump(local().counters[c], n);
+	}
+
+	void record(histogram h, boost::uint64_t microseconds)
+	{
+		shard::timings& t = local().histograms[h];
+		bump(t.buckets[bucket_of(microseconds)], 1);
+		bump(t.sum, microseconds);
+	}
+
+	/*
+	*	Registers the gauges of a session.  They are reported for as long as the session holds
+	*	the returned pointer.
+	*/
+	boost::shared_ptr<session_gauges> add_session(const std::string& name)
+	{
+		boost::shared_ptr<session_gauges> gauges = boost::make_shared<session_gauges>(name);
+		boost::mutex::scoped_lock lock(mtx_);
+		sessions_.push_back(gauges);
+		return gauges;
+	}
+
+	/*
+	*	Every metric, in the Prometheus text exposition format.
+	*/
+	std::string scrape()
+	{
+		static const char* counter_names[counter_count][2] = {
+			{ "spreadsheet_connections_accepted_total", "Connections accepted on the client port." },
+			{ "spreadsheet_joins_total", "JOINs that joined a session." },
+			{ "spreadsheet_changes_committed_total", "CHANGEs committed." },
+			{ "spreadsheet_changes_waited_total", "CHANGEs and BATCH CHANGEs answered with WAIT." },
+			{ "spreadsheet_batch_changes_committed_total", "BATCH CHANGEs committed." },
+			{ "spreadsheet_undos_total", "UNDOs applied." },
+			{ "spreadsheet_saves_total", "Saves made durable, by a journal sync or a sheet file write." },
+			{ "spreadsheet_save_failures_total", "Saves that could not be made durable." },
+			{ "spreadsheet_updates_sent_total", "UPDATE and UPDATE BATCH messages queued to other users." },
+			{ "spreadsheet_sessions_loaded_total", "Sessions loaded for a JOIN." },
+			{ "spreadsheet_sessions_unloaded_total", "Idle sessions unloaded." }
+		};
+		static const char* histogram_names[histogram_count][2] = {
+			{ "spreadsheet_accept_seconds", "Time to set up an accepted connection." },
+			{ "spreadsheet_join_seconds", "Time to add a user to a session and queue JOIN OK." },
+			{ "spreadsheet_current_state_seconds", "Time to serialize the cells for JOIN OK." },
+			{ "spreadsheet_change_seconds", "Time from applying a CHANGE or BATCH CHANGE to queueing its reply." },
+			{ "spreadsheet_update_seconds", "Time to fan an UPDATE out to the other users." },
+			{ "spreadsheet_undo_seconds", "Time to apply an UNDO." },
+			{ "spreadsheet_save_seconds", "Time from starting a save to it being durable." },
+			{ "spreadsheet_load_seconds", "Time to load a session from its files." }
+		};
+
+		std::vector<boost::shared_ptr<shard> > shards;
+		std::vector<boost::shared_ptr<session_gauges> > sessions;
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			shards = shards_;
+			std::size_t kept = 0;
+			for(std::size_t i = 0; i < sessions_.size(); i++)
+			{
+				boost::shared_ptr<session_gauges> gauges = sessions_[i].lock();
+				if(!gauges)
+					continue;
+				sessions.push_back(gauges);
+				sessions_[kept++] = sessions_[i];
+			}
+			sessions_.resize(kept);
+		}
+
+		std::string out;
+		char line[256];
+		for(int c = 0; c < counter_count; c++)
+		{
+			boost::uint64_t total = 0;
+			for(std::size_t i = 0; i < shards.size(); i++)
+				total += shards[i]->counters[c].load(boost::memory_order_relaxed);
+			header(out, counter_names[c][0], counter_names[c][1], "counter");
+			std::snprintf(line, sizeof(line), "%s %llu\n", counter_names[c][0], static_cast<unsigned long long>(total));
+			out += line;
+		}
+
+		static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+		std::vector<boost::uint64_t> buckets(bucket_count);
+		for(int h = 0; h < histogram_count; h++)
+		{
+			std::fill(buckets.begin(), buckets.end(), 0);
+			boost::uint64_t count = 0, sum = 0;
+			for(std::size_t i = 0; i < shards.size(); i++)
+			{
+				const shard::timings& t = shards[i]->histograms[h];
+				for(std::size_t b = 0; b < bucket_count; b++)
+				{
+					boost::uint64_t n = t.buckets[b].load(boost::memory_order_relaxed);
+					buckets[b] += n;
+					count += n;
+				}
+				sum += t.sum.load(boost::memory_order_relaxed);
+			}
+
+			const char* name = histogram_names[h][0];
+			header(out, name, histogram_names[h][1], "summary");
+			for(std::size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+			{
+				std::snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.6f\n", name, quantiles[q],
+					quantile(buckets, count, quantiles[q]) / 1e6);
+				out += line;
+			}
+			std::snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n", name, sum / 1e6, name,
+				static_cast<unsigned long long>(count));
+			out += line;
+		}
+
+		gauge(out, sessions, "spreadsheet_session_users", "Users connected to the session.", &session_gauges::users);
+		gauge(out, sessions, "spreadsheet_session_undo_depth", "Changes the session can undo.", &session_gauges::undo_depth);
+		gauge(out, sessions, "spreadsheet_session_cells", "Cells with contents in the session.", &session_gauges::cells);
+		gauge(out, sessions, "spreadsheet_session_memory_bytes", "Estimated memory the session holds.", &session_gauges::memory);
+		return out;
+	}
+
+private:
+	enum { sub_bucket_bits = 3, sub_buckets = 1 << sub_bucket_bits, bucket_count = 64 * sub_buckets };
+
+	struct shard
+	{
+		shard()
+		{
+			for(int c = 0; c < counter_count; c++)
+				counters[c].store(0, boost::memory_order_relaxed);
+		}
+
+		struct timings
+		{
+			timings()
+				: sum(0)
+			{
+				for(std::size_t b = 0; b < bucket_count; b++)
+					buckets[b].store(0, boost::memory_order_relaxed);
+			}
+
+			boost::atomic<boost::uint64_t> buckets[bucket_count];
+			boost::atomic<boost::uint64_t> sum;
+		};
+
+		boost::atomic<boost::uint64_t> counters[counter_count];
+		timings histograms[histogram_count];
+	};
+
+	/*
+	*	Holds the calling thread's shard.  The shard itself is owned by shards_, so what a thread
+	*	recorded is still counted after it exits.
+	*/
+	struct shard_handle
+	{
+		boost::shared_ptr<shard> owned;
+	};
+
+	server_metrics()
+	{
+	}
+
+	shard& local()
+	{
+		shard_handle* handle = handles_.get();
+		if(handle == NULL)
+		{
+			handle = new shard_handle();
+			handle->owned = boost::make_shared<shard>();
+			handles_.reset(handle);
+			boost::mutex::scoped_lock lock(mtx_);
+			shards_.push_back(handle->owned);
+		}
+		return *handle->owned;
+	}
+
+	/*
+	*	Only the owning thread writes a shard, so an add needs no read-modify-write instruction.
+	*/
+	static void bump(boost::atomic<boost::uint64_t>& value, boost::uint64_t n)
+	{
+		value.store(value.load(boost::memory_order_relaxed) + n, boost::memory_order_relaxed);
+	}
+
+	/*
+	*	Values below 2 * sub_buckets have a bucket each; above that each power of two has
+	*	sub_buckets buckets.
+	*/
+	static std::size_t bucket_of(boost::uint64_t value)
+	{
+		if(value < 2 * sub_buckets)
+			return value;
+		int top = 63 - __builtin_clzll(value);
+		int shift = top - sub_bucket_bits;
+		return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+	}
+
+	/*
+	*	The largest value that falls in bucket.
+	*/
+	static boost::uint64_t bucket_top(std::size_t bucket)
+	{
+		if(bucket < 2 * sub_buckets)
+			return bucket;
+		int shift = bucket / sub_buckets - 1;
+		boost::uint64_t base = (sub_buckets + bucket % sub_buckets);
+		return ((base + 1) << shift) - 1;
+	}
+
+	static double quantile(const std::vector<boost::uint64_t>& buckets, boost::uint64_t count, double q)
+	{
+		if(count == 0)
+			return 0;
+		boost::uint64_t rank = static_cast<boost::uint64_t>(q * count + 0.5);
+		if(rank == 0)
+			rank = 1;
+		boost::uint64_t seen = 0;
+		for(std::size_t b = 0; b < buckets.size(); b++)
+		{
+			seen += buckets[b];
+			if(seen >= rank)
+				return bucket_top(b);
+		}
+		return bucket_top(buckets.size() - 1);
+	}
+
+	static void header(std::string& out, const char* name, const char* help, const char* type)
+	{
+		out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+		out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+	}
+
+	static void gauge(std::string& out, const std::vector<boost::shared_ptr<session_gauges> >& sessions,
+		const char* name, const char* help, boost::atomic<long> session_gauges::* field)
+	{
+		header(out, name, help, "gauge");
+		char value[32];
+		for(std::size_t i = 0; i < sessions.size(); i++)
+		{
+			std::snprintf(value, sizeof(value), "%ld", ((*sessions[i]).*field).load(boost::memory_order_relaxed));
+			out.append(name).append("{sheet=\"");
+			label(out, sessions[i]->name);
+			out.append("\"} ").append(value).append("\n");
+		}
+	}
+
+	static void label(std::string& out, const std::string& text)
+	{
+		for(std::size_t i = 0; i < text.size(); i++)
+		{
+			if(text[i] == '\\' || text[i] == '"')
+				out += '\\';
+			if(text[i] == '\n')
+				out += "\\n";
+			else
+				out += text[i];
+		}
+	}
+
+	// Guards shards_ and sessions_
+	boost::mutex mtx_;
+	std::vector<boost::shared_ptr<shard> > shards_;
+	std::vector<boost::weak_ptr<session_gauges> > sessions_;
+	boost::thread_specific_ptr<shard_handle> handles_;
+};
+
+/*
+*	Records the time from its construction to its destruction in a histogram.
+*/
+class latency_timer
+{
+public:
+	explicit latency_timer(server_metrics::histogram h)
+		: histogram_(h), start_(server_metrics::now())
+	{
+	}
+
+	~latency_timer()
+	{
+		server_metrics::instance().record(histogram_, server_metrics::now() - start_);
+	}
+
+private:
+	server_metrics::histogram histogram_;
+	boost::uint64_t start_;
+};
+
+/*
+*	Serves the metrics over HTTP on a port of the loopback interface, for Prometheus or curl:
+*	GET /metrics returns them as text/plain.  Each request gets one response and the connection
+*	is closed.
+*/
+class metrics_endpoint
+{
+public:
+	metrics_endpoint(boost::asio::io_service& io_service, unsigned short port)
+		: io_service_(io_service), acceptor_(io_service)
+	{
+		using boost::asio::ip::tcp;
+		boost::system::error_code error;
+		tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+		acceptor_.open(endpoint.protocol(), error);
+		if(!error)
+			acceptor_.set_option(tcp::acceptor::reuse_address(true), error);
+		if(!error)
+			acceptor_.bind(endpoint, error);
+		if(!error)
+			acceptor_.listen(boost::asio::socket_base::max_connections, error);
+		if(error)
+		{
+			error_ = error.message();
+			return;
+		}
+		start_accept();
+	}
+
+	/*
+	*	Why the port could not be opened, or empty if it was.
+	*/
+	const std::string& error() const
+	{
+		return error_;
+	}
+
+private:
+	struct exchange
+	{
+		explicit exchange(boost::asio::io_service& io_service)
+			: socket(io_service)
+		{
+		}
+
+		boost::asio::ip::tcp::socket socket;
+		boost::asio::streambuf request;
+		std::string response;
+	};
+
+	void start_accept()
+	{
+		boost::shared_ptr<exchange> e = boost::make_shared<exchange>(boost::ref(io_service_));
+		acceptor_.async_accept(e->socket,
+			boost::bind(&metrics_endpoint::handle_accept, this, e, boost::asio::placeholders::error));
+	}
+
+	void handle_accept(boost::shared_ptr<exchange> e, const boost::system::error_code& error)
+	{
+		if(!error)
+			boost::asio::async_read_until(e->socket, e->request, "\r\n\r\n",
+				boost::bind(&metrics_endpoint::handle_request, this, e, boost::asio::placeholders::error));
+		start_accept();
+	}
+
+	void handle_request(boost::shared_ptr<exchange> e, const boost::system::error_code& error)
+	{
+		if(error)
+			return;
+		std::istream request(&e->request);
+		std::string method, path;
+		request >> method >> path;
+		if(method == "GET" && (path == "/metrics" || path == "/"))
+		{
+			std::string body = server_metrics::instance().scrape();
+			char length[32];
+			std::snprintf(length, sizeof(length), "%lu", static_cast<unsigned long>(body.size()));
+			e->response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+			e->response.append(length).append("\r\n\r\n").append(body);
+		}
+		else
+			e->response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		boost::asio::async_write(e->socket, boost::asio::buffer(e->response),
+			boost::bind(&metrics_endpoint::handle_written, e, boost::asio::placeholders::error));
+	}
+
+	/*
+	*	The response is the whole exchange, so the socket is closed whether or not it was sent.
+	*/
+	static void handle_written(boost::shared_ptr<exchange> e, const boost::system::error_code& /*error*/)
+	{
+		boost::system::error_code ignored;
+		e->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+		e->socket.close(ignored);
+	}
+
+	boost::asio::io_service& io_service_;
+	boost::asio::ip::tcp::acceptor acceptor_;
+	std::string error_;
+};
+
+#endif
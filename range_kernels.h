@@ -0,0 +1,225 @@
+//
+// range_kernels.h
+// ~~~~~~~~~~~~~~~
+//
+// Vectorized kernels that total a run of cached cell values.
+//
+
+#ifndef RANGE_KERNELS_H
+#define RANGE_KERNELS_H
+
+#include <cmath>
+#include <cstddef>
+#include <boost/cstdint.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RANGE_KERNELS_X86 1
+#endif
+
+/*
+*	The totals of a run of values: their sum, how many there are, the smallest and largest, and
+*	whether any of them is NaN.  A value only counts where its mask is all ones; elsewhere the
+*	value must be 0.
+*/
+struct range_totals
+{
+	double sum;
+	double count;
+	double min;
+	double max;
+	bool nan;
+
+	range_totals()
+		: sum(0), count(0), min(HUGE_VAL), max(-HUGE_VAL), nan(false)
+	{
+	}
+
+	/*
+	*	Adds the totals of the run that follows this one.
+	*/
+	void merge(const range_totals& next)
+	{
+		sum += next.sum;
+		count += next.count;
+		min = next.min < min ? next.min : min;
+		max = next.max > max ? next.max : max;
+		nan = nan || next.nan;
+	}
+};
+
+/*
+*	Every kernel adds element i of a run into lane i % 4, folds the lanes as
+*	(lane 0 + lane 1) + (lane 2 + lane 3), and then adds the last n % 4 elements one at a time.
+*	Keeping that order in the scalar, SSE2 and AVX kernels makes them return identical bits,
+*	so the answer does not depend on the machine the server runs on.
+*/
+namespace range_kernels
+{
+	typedef void (*kernel)(const double*, const boost::uint64_t*, std::size_t, range_totals&);
+
+	inline void finish(const double* sum, const double* count, const double* min, const double* max, bool nan,
+		const double* values, const boost::uint64_t* mask, std::size_t start, std::size_t n, range_totals& out)
+	{
+		range_totals run;
+		run.sum = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+		run.count = (count[0] + count[1]) + (count[2] + count[3]);
+		double low = min[1] < min[0] ? min[1] : min[0];
+		double high = max[1] > max[0] ? max[1] : max[0];
+		double low2 = min[3] < min[2] ? min[3] : min[2];
+		double high2 = max[3] > max[2] ? max[3] : max[2];
+		run.min = low2 < low ? low2 : low;
+		run.max = high2 > high ? high2 : high;
+		run.nan = nan;
+
+		for(std::size_t i = start; i < n; i++)
+		{
+			run.sum += values[i];
+			if(mask[i] == 0)
+				continue;
+			run.count += 1;
+			if(values[i] != values[i])
+				run.nan = true;
+			run.min = values[i] < run.min ? values[i] : run.min;
+			run.max = values[i] > run.max ? values[i] : run.max;
+		}
+		out.merge(run);
+	}
+
+	inline void scalar(const double* values, const boost::uint64_t* mask, std::size_t n, range_totals& out)
+	{
+		double sum[4] = { 0, 0, 0, 0 };
+		double count[4] = { 0, 0, 0, 0 };
+		double min[4] = { HUGE_VAL, HUGE_VAL, HUGE_VAL, HUGE_VAL };
+		double max[4] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+		bool nan = false;
+		std::size_t blocks = n & ~std::size_t(3);
+		for(std::size_t i = 0; i < blocks; i += 4)
+			for(int lane = 0; lane < 4; lane++)
+			{
+				double v = values[i + lane];
+				sum[lane] += v;
+				if(mask[i + lane] == 0)
+					continue;
+				count[lane] += 1;
+				if(v != v)
+					nan = true;
+				min[lane] = v < min[lane] ? v : min[lane];
+				max[lane] = v > max[lane] ? v : max[lane];
+			}
+		finish(sum, count, min, max, nan, values, mask, blocks, n, out);
+	}
+
+#ifdef RANGE_KERNELS_X86
+	__attribute__((target("sse2")))
+	inline void sse2(const double* values, const boost::uint64_t* mask, std::size_t n, range_totals& out)
+	{
+		const __m128d one = _mm_set1_pd(1.0);
+		const __m128d high = _mm_set1_pd(HUGE_VAL);
+		const __m128d low = _mm_set1_pd(-HUGE_VAL);
+		__m128d sum01 = _mm_setzero_pd(), sum23 = _mm_setzero_pd();
+		__m128d count01 = _mm_setzero_pd(), count23 = _mm_setzero_pd();
+		__m128d min01 = high, min23 = high;
+		__m128d max01 = low, max23 = low;
+		__m128d nan = _mm_setzero_pd();
+
+		std::size_t blocks = n & ~std::size_t(3);
+		for(std::size_t i = 0; i < blocks; i += 4)
+		{
+			__m128d v01 = _mm_loadu_pd(values + i);
+			__m128d v23 = _mm_loadu_pd(values + i + 2);
+			__m128d m01 = _mm_loadu_pd(reinterpret_cast<const double*>(mask + i));
+			__m128d m23 = _mm_loadu_pd(reinterpret_cast<const double*>(mask + i + 2));
+
+			sum01 = _mm_add_pd(sum01, v01);
+			sum23 = _mm_add_pd(sum23, v23);
+			count01 = _mm_add_pd(count01, _mm_and_pd(m01, one));
+			count23 = _mm_add_pd(count23, _mm_and_pd(m23, one));
+			nan = _mm_or_pd(nan, _mm_or_pd(_mm_cmpunord_pd(v01, v01), _mm_cmpunord_pd(v23, v23)));
+
+			//values that are not numbers take no part in the min and max
+			__m128d lo01 = _mm_or_pd(_mm_and_pd(m01, v01), _mm_andnot_pd(m01, high));
+			__m128d lo23 = _mm_or_pd(_mm_and_pd(m23, v23), _mm_andnot_pd(m23, high));
+			__m128d hi01 = _mm_or_pd(_mm_and_pd(m01, v01), _mm_andnot_pd(m01, low));
+			__m128d hi23 = _mm_or_pd(_mm_and_pd(m23, v23), _mm_andnot_pd(m23, low));
+			min01 = _mm_min_pd(lo01, min01);
+			min23 = _mm_min_pd(lo23, min23);
+			max01 = _mm_max_pd(hi01, max01);
+			max23 = _mm_max_pd(hi23, max23);
+		}
+
+		double sum[4], count[4], min[4], max[4];
+		_mm_storeu_pd(sum, sum01);
+		_mm_storeu_pd(sum + 2, sum23);
+		_mm_storeu_pd(count, count01);
+		_mm_storeu_pd(count + 2, count23);
+		_mm_storeu_pd(min, min01);
+		_mm_storeu_pd(min + 2, min23);
+		_mm_storeu_pd(max, max01);
+		_mm_storeu_pd(max + 2, max23);
+		finish(sum, count, min, max, _mm_movemask_pd(nan) != 0, values, mask, blocks, n, out);
+	}
+
+	__attribute__((target("avx")))
+	inline void avx(const double* values, const boost::uint64_t* mask, std::size_t n, range_totals& out)
+	{
+		const __m256d one = _mm256_set1_pd(1.0);
+		const __m256d high = _mm256_set1_pd(HUGE_VAL);
+		const __m256d low = _mm256_set1_pd(-HUGE_VAL);
+		__m256d sum_lanes = _mm256_setzero_pd();
+		__m256d count_lanes = _mm256_setzero_pd();
+		__m256d min_lanes = high;
+		__m256d max_lanes = low;
+		__m256d nan = _mm256_setzero_pd();
+
+		std::size_t blocks = n & ~std::size_t(3);
+		for(std::size_t i = 0; i < blocks; i += 4)
+		{
+			__m256d v = _mm256_loadu_pd(values + i);
+			__m256d m = _mm256_loadu_pd(reinterpret_cast<const double*>(mask + i));
+
+			sum_lanes = _mm256_add_pd(sum_lanes, v);
+			count_lanes = _mm256_add_pd(count_lanes, _mm256_and_pd(m, one));
+			nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+			min_lanes = _mm256_min_pd(_mm256_blendv_pd(high, v, m), min_lanes);
+			max_lanes = _mm256_max_pd(_mm256_blendv_pd(low, v, m), max_lanes);
+		}
+
+		double sum[4], count[4], min[4], max[4];
+		_mm256_storeu_pd(sum, sum_lanes);
+		_mm256_storeu_pd(count, count_lanes);
+		_mm256_storeu_pd(min, min_lanes);
+		_mm256_storeu_pd(max, max_lanes);
+		bool any_nan = _mm256_movemask_pd(nan) != 0;
+		_mm256_zeroupper();
+		finish(sum, count, min, max, any_nan, values, mask, blocks, n, out);
+	}
+#endif
+
+	/*
+	*	The fastest kernel the processor supports, chosen on first use.
+	*/
+	inline kernel best()
+	{
+#ifdef RANGE_KERNELS_X86
+		static const kernel chosen = __builtin_cpu_supports("avx") ? avx :
+			__builtin_cpu_supports("sse2") ? sse2 : scalar;
+		return chosen;
+#else
+		return scalar;
+#endif
+	}
+
+	inline const char* name(kernel k)
+	{
+#ifdef RANGE_KERNELS_X86
+		if(k == avx)
+			return "avx";
+		if(k == sse2)
+			return "sse2";
+#endif
+		return "scalar";
+	}
+}
+
+#endif
@@ -0,0 +1,201 @@
+//
+// recalc_pool.h
+// ~~~~~~~~~~~~~
+//
+// Work-stealing thread pool that spreads formula recalculation across cores.
+//
+
+#ifndef RECALC_POOL_H
+#define RECALC_POOL_H
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+
+/*
+*	The recalc_pool runs the pieces of a parallel_for() on a fixed set of worker threads.
+*
+*	Each worker has its own queue of chunks.  A parallel_for() deals its chunks out across the
+*	queues; a worker takes chunks from the back of its own queue and, once that is empty,
+*	steals from the front of the others, so an uneven split evens out without a shared queue
+*	every chunk has to pass through.  The calling thread works on chunks too while it waits.
+*
+*	One pool is shared by every session.  Several sessions may run parallel_for() at once;
+*	their chunks mix in the queues and each call returns as soon as its own chunks are done.
+*/
+class recalc_pool
+{
+public:
+	typedef boost::function<void (std::size_t, std::size_t)> range_task;
+
+	explicit recalc_pool(std::size_t threads)
+		: queued_(0), next_queue_(0), stopping_(false)
+	{
+		for(std::size_t i = 0; i < threads; i++)
+			queues_.push_back(boost::make_shared<queue>());
+		for(std::size_t i = 0; i < threads; i++)
+			workers_.create_thread(boost::bind(&recalc_pool::run, this, i));
+	}
+
+	~recalc_pool()
+	{
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			stopping_ = true;
+		}
+		work_cv_.notify_all();
+		workers_.join_all();
+	}
+
+	/*
+	*	The number of worker threads.
+	*/
+	std::size_t size() const
+	{
+		return queues_.size();
+	}
+
+	/*
+	*	Calls task(begin, end) over [0, count) in chunks of at most grain, in parallel, and
+	*	returns once every chunk has run.  Chunks must not depend on each other.
+	*/
+	void parallel_for(std::size_t count, std::size_t grain, range_task task)
+	{
+		if(count == 0)
+			return;
+		if(queues_.empty() || count <= grain)
+		{
+			task(0, count);
+			return;
+		}
+
+		job current(task, (count + grain - 1) / grain);
+		std::size_t first = next_queue_.fetch_add(1) % queues_.size();
+		for(std::size_t begin = 0, i = 0; begin < count; begin += grain, i++)
+		{
+			chunk c = { &current, begin, std::min(count, begin + grain) };
+			queue& q = *queues_[(first + i) % queues_.size()];
+			boost::mutex::scoped_lock lock(q.mtx);
+			q.chunks.push_back(c);
+		}
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			queued_ += current.remaining;
+		}
+		work_cv_.notify_all();
+
+		//help out until every chunk of this call is done
+		chunk c;
+		while(current.remaining.load() != 0 && take(first, c))
+			execute(c);
+
+		boost::mutex::scoped_lock lock(done_mtx_);
+		while(current.remaining.load() != 0)
+			done_cv_.wait(lock);
+	}
+
+private:
+	struct job
+	{
+		job(const range_task& task, std::size_t chunks)
+			: task(task), remaining(chunks)
+		{
+		}
+
+		const range_task& task;
+		boost::atomic<std::size_t> remaining;
+	};
+
+	struct chunk
+	{
+		job* owner;
+		std::size_t begin;
+		std::size_t end;
+	};
+
+	struct queue
+	{
+		boost::mutex mtx;
+		std::deque<chunk> chunks;
+	};
+
+	void run(std::size_t index)
+	{
+		chunk c;
+		for(;;)
+		{
+			if(take(index, c))
+			{
+				execute(c);
+				continue;
+			}
+
+			boost::mutex::scoped_lock lock(mtx_);
+			while(queued_ == 0 && !stopping_)
+				work_cv_.wait(lock);
+			if(stopping_)
+				return;
+		}
+	}
+
+	/*
+	*	Takes a chunk from the back of queue index, or else steals one from the front of another.
+	*/
+	bool take(std::size_t index, chunk& c)
+	{
+		for(std::size_t i = 0; i < queues_.size(); i++)
+		{
+			queue& q = *queues_[(index + i) % queues_.size()];
+			boost::mutex::scoped_lock lock(q.mtx);
+			if(q.chunks.empty())
+				continue;
+			if(i == 0)
+			{
+				c = q.chunks.back();
+				q.chunks.pop_back();
+			}
+			else
+			{
+				c = q.chunks.front();
+				q.chunks.pop_front();
+			}
+			lock.unlock();
+
+			boost::mutex::scoped_lock count_lock(mtx_);
+			queued_--;
+			return true;
+		}
+		return false;
+	}
+
+	void execute(const chunk& c)
+	{
+		c.owner->task(c.begin, c.end);
+		if(--c.owner->remaining == 0)
+		{
+			boost::mutex::scoped_lock lock(done_mtx_);
+			done_cv_.notify_all();
+		}
+	}
+
+	std::vector<boost::shared_ptr<queue> > queues_;
+	boost::thread_group workers_;
+	// Guards queued_ and stopping_, workers sleep on work_cv_ while nothing is queued
+	boost::mutex mtx_;
+	boost::condition_variable work_cv_;
+	std::size_t queued_;
+	// Callers sleep on done_cv_ until their last chunk finishes
+	boost::mutex done_mtx_;
+	boost::condition_variable done_cv_;
+	// Spreads the first chunk of each call across the queues
+	boost::atomic<std::size_t> next_queue_;
+	bool stopping_;
+};
+
+#endif
@@ -0,0 +1,423 @@
+//
+// server_log.h
+// ~~~~~~~~~~~~
+//
+// Leveled logging that hands records to a background thread instead of writing them inline.
+//
+
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <iostream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+/*
+*	Records below LOG_LEVEL are compiled out, their arguments are never evaluated.  Build with
+*	-DLOG_LEVEL=0 to log every message sent and received.
+*/
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/*
+*	Logs text, anything that can follow << on an ostream, at level:
+*
+*	LOG_INFO("Opening file in SS Session: " << filename);
+*/
+#define SERVER_LOG(level, text) \
+	do \
+	{ \
+		if((level) >= LOG_LEVEL) \
+		{ \
+			server_log& log_ = server_log::instance(); \
+			log_.begin() << text; \
+			log_.commit(level); \
+		} \
+	} while(0)
+
+#define LOG_TRACE(text) SERVER_LOG(LOG_LEVEL_TRACE, text)
+#define LOG_DEBUG(text) SERVER_LOG(LOG_LEVEL_DEBUG, text)
+#define LOG_INFO(text) SERVER_LOG(LOG_LEVEL_INFO, text)
+#define LOG_WARN(text) SERVER_LOG(LOG_LEVEL_WARN, text)
+#define LOG_ERROR(text) SERVER_LOG(LOG_LEVEL_ERROR, text)
+
+/*
+*	The server_log formats each record on the thread that logs it, into a buffer that thread
+*	owns, and copies it with a timestamp into that thread's ring.  Each ring has one writer, its
+*	thread, and one reader, the drain thread, so neither takes a lock: the writer publishes a
+*	record by moving the head forward and the reader frees it by moving the tail.  A record that
+*	does not fit in the ring is dropped and counted rather than making the thread wait.
+*
+*	Every few milliseconds the drain thread empties all the rings, orders what it took by time
+*	and writes it to the log file.  Until start() is called records are written straight to
+*	std::clog instead.
+*/
+class server_log
+{
+public:
+	static server_log& instance()
+	{
+		static server_log log;
+		return log;
+	}
+
+	/*
+	*	Starts the drain thread, appending to the file at path.  Returns false if the file cannot
+	*	be opened.
+	*/
+	bool start(const std::string& path)
+	{
+		boost::mutex::scoped_lock lock(mtx_);
+		if(out_ != NULL)
+			return true;
+		out_ = std::fopen(path.c_str(), "a");
+		if(out_ == NULL)
+			return false;
+		std::setvbuf(out_, NULL, _IOFBF, 1 << 16);
+		stopping_ = false;
+		drain_thread_ = boost::thread(boost::bind(&server_log::run, this));
+		started_.store(true, boost::memory_order_release);
+		return true;
+	}
+
+	/*
+	*	Writes out every record logged so far and stops the drain thread.
+	*/
+	void stop()
+	{
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			if(out_ == NULL)
+				return;
+			started_.store(false, boost::memory_order_release);
+			stopping_ = true;
+		}
+		wake_.notify_all();
+		drain_thread_.join();
+		std::fclose(out_);
+		out_ = NULL;
+	}
+
+	~server_log()
+	{
+		stop();
+	}
+
+	/*
+	*	The stream a record is formatted into.  Use the LOG_ macros rather than calling this.
+	*/
+	std::ostream& begin()
+	{
+		writer* w = writers_.get();
+		if(w == NULL)
+		{
+			w = new writer(add_ring());
+			writers_.reset(w);
+		}
+		w->buffer.reset();
+		w->stream.clear();
+		return w->stream;
+	}
+
+	/*
+	*	Queues the record formatted since begin().
+	*/
+	void commit(int level)
+	{
+		writer* w = writers_.get();
+		boost::uint64_t time = now();
+		if(!started_.load(boost::memory_order_acquire))
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			std::string line;
+			format(line, time, level, w->queue->id(), w->buffer.text(), w->buffer.size());
+			std::clog << line;
+			return;
+		}
+		w->queue->push(level, time, w->buffer.text(), w->buffer.size());
+	}
+
+private:
+	/*
+	*	A streambuf over a fixed buffer.  Text past the end of the buffer is cut off.
+	*/
+	class fixed_buffer : public std::streambuf
+	{
+	public:
+		fixed_buffer()
+			: bytes_(max_record)
+		{
+			reset();
+		}
+
+		void reset()
+		{
+			setp(&bytes_[0], &bytes_[0] + bytes_.size());
+		}
+
+		const char* text() const
+		{
+			return pbase();
+		}
+
+		std::size_t size() const
+		{
+			return pptr() - pbase();
+		}
+
+	private:
+		std::vector<char> bytes_;
+	};
+
+	struct record_header
+	{
+		// The whole record, header and padding included
+		boost::uint32_t size;
+		boost::uint16_t level;
+		// The text, at most max_record bytes
+		boost::uint16_t length;
+		boost::uint64_t time;
+	};
+
+	/*
+	*	A single writer, single reader queue of records in a circular byte buffer.  head_ and
+	*	tail_ only grow; their difference is the bytes in use.  A record never wraps: when it
+	*	does not fit before the end of the buffer the rest of the buffer is skipped with a
+	*	padding record.
+	*/
+	class ring
+	{
+	public:
+		explicit ring(boost::uint16_t id)
+			: bytes_(capacity), head_(0), tail_(0), dropped_(0), id_(id)
+		{
+		}
+
+		void push(int level, boost::uint64_t time, const char* text, std::size_t length)
+		{
+			boost::uint64_t head = head_.load(boost::memory_order_relaxed);
+			boost::uint64_t tail = tail_.load(boost::memory_order_acquire);
+			std::size_t total = (sizeof(record_header) + length + 15) & ~std::size_t(15);
+			std::size_t offset = head & (capacity - 1);
+			std::size_t pad = capacity - offset < total ? capacity - offset : 0;
+			if(total + pad > capacity - (head - tail))
+			{
+				dropped_.fetch_add(1, boost::memory_order_relaxed);
+				return;
+			}
+			if(pad != 0)
+			{
+				record_header padding = { static_cast<boost::uint32_t>(pad), padding_level, 0, 0 };
+				std::memcpy(&bytes_[offset], &padding, sizeof(padding));
+				head += pad;
+				offset = 0;
+			}
+			record_header header = { static_cast<boost::uint32_t>(total), static_cast<boost::uint16_t>(level),
+				static_cast<boost::uint16_t>(length), time };
+			std::memcpy(&bytes_[offset], &header, sizeof(header));
+			std::memcpy(&bytes_[offset + sizeof(header)], text, length);
+			head_.store(head + total, boost::memory_order_release);
+		}
+
+		/*
+		*	Calls f(header, text, length) for every queued record, then frees them.
+		*/
+		template <typename Function>
+		void drain(Function f)
+		{
+			boost::uint64_t tail = tail_.load(boost::memory_order_relaxed);
+			boost::uint64_t head = head_.load(boost::memory_order_acquire);
+			while(tail < head)
+			{
+				record_header header;
+				const char* at = &bytes_[tail & (capacity - 1)];
+				std::memcpy(&header, at, sizeof(header));
+				if(header.level != padding_level)
+					f(header, at + sizeof(header), static_cast<std::size_t>(header.length));
+				tail += header.size;
+			}
+			tail_.store(tail, boost::memory_order_release);
+		}
+
+		boost::uint64_t dropped() const
+		{
+			return dropped_.load(boost::memory_order_relaxed);
+		}
+
+		boost::uint16_t id() const
+		{
+			return id_;
+		}
+
+	private:
+		std::vector<char> bytes_;
+		boost::atomic<boost::uint64_t> head_;
+		boost::atomic<boost::uint64_t> tail_;
+		boost::atomic<boost::uint64_t> dropped_;
+		boost::uint16_t id_;
+	};
+
+	struct writer
+	{
+		explicit writer(boost::shared_ptr<ring> queue)
+			: stream(&buffer), queue(queue)
+		{
+		}
+
+		fixed_buffer buffer;
+		std::ostream stream;
+		boost::shared_ptr<ring> queue;
+	};
+
+	struct line
+	{
+		boost::uint64_t time;
+		int level;
+		boost::uint16_t thread;
+		std::string text;
+
+		bool operator<(const line& other) const
+		{
+			return time < other.time;
+		}
+	};
+
+	enum { capacity = 1 << 20, max_record = 0xffff, padding_level = 0xffff };
+
+	server_log()
+		: out_(NULL), started_(false), stopping_(false), next_id_(0)
+	{
+	}
+
+	boost::shared_ptr<ring> add_ring()
+	{
+		boost::mutex::scoped_lock lock(mtx_);
+		boost::shared_ptr<ring> r = boost::make_shared<ring>(next_id_++);
+		rings_.push_back(r);
+		return r;
+	}
+
+	void run()
+	{
+		std::vector<line> lines;
+		std::vector<boost::uint64_t> reported;
+		std::string text;
+		for(;;)
+		{
+			bool stopping;
+			std::vector<boost::shared_ptr<ring> > rings;
+			{
+				boost::mutex::scoped_lock lock(mtx_);
+				wake_.timed_wait(lock, boost::posix_time::milliseconds(10));
+				stopping = stopping_;
+				rings = rings_;
+			}
+
+			lines.clear();
+			reported.resize(rings.size(), 0);
+			for(std::size_t i = 0; i < rings.size(); i++)
+			{
+				rings[i]->drain(boost::bind(&server_log::take, boost::ref(lines), rings[i]->id(), _1, _2, _3));
+				boost::uint64_t dropped = rings[i]->dropped();
+				if(dropped != reported[i])
+				{
+					line l = { now(), LOG_LEVEL_WARN, rings[i]->id(), "" };
+					std::ostringstream message;
+					message << "Dropped " << dropped - reported[i] << " records, the ring was full.";
+					l.text = message.str();
+					lines.push_back(l);
+					reported[i] = dropped;
+				}
+			}
+			std::stable_sort(lines.begin(), lines.end());
+			for(std::size_t i = 0; i < lines.size(); i++)
+			{
+				format(text, lines[i].time, lines[i].level, lines[i].thread, lines[i].text.data(), lines[i].text.size());
+				std::fwrite(text.data(), 1, text.size(), out_);
+			}
+			if(!lines.empty())
+				std::fflush(out_);
+			if(stopping)
+				return;
+		}
+	}
+
+	/*
+	*	Nanoseconds since the epoch.
+	*/
+	static boost::uint64_t now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	}
+
+	static void take(std::vector<line>& lines, boost::uint16_t thread, const record_header& header,
+		const char* text, std::size_t length)
+	{
+		line l;
+		l.time = header.time;
+		l.level = header.level;
+		l.thread = thread;
+		l.text.assign(text, length);
+		lines.push_back(l);
+	}
+
+	/*
+	*	2013-04-20 14:03:59.123456 INFO  t2 text
+	*/
+	static void format(std::string& out, boost::uint64_t time, int level, boost::uint16_t thread,
+		const char* text, std::size_t length)
+	{
+		static const char* names[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+		char stamp[64];
+		time_t seconds = time / 1000000000ull;
+		tm local;
+		localtime_r(&seconds, &local);
+		std::size_t used = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+		used += std::snprintf(stamp + used, sizeof(stamp) - used, ".%06u ",
+			static_cast<unsigned>(time % 1000000000ull / 1000));
+		used += std::snprintf(stamp + used, sizeof(stamp) - used, "%s t%u ",
+			names[level < 0 || level > 4 ? 4 : level], static_cast<unsigned>(thread));
+		out.assign(stamp, used);
+		out.append(text, length);
+		out += '\n';
+	}
+
+	// Guards out_, stopping_ and rings_
+	boost::mutex mtx_;
+	boost::condition_variable wake_;
+	std::FILE* out_;
+	// Set while the drain thread runs, read without the lock by every record
+	boost::atomic<bool> started_;
+	bool stopping_;
+	boost::thread drain_thread_;
+	// One ring per thread that ever logged, in the order they first did
+	std::vector<boost::shared_ptr<ring> > rings_;
+	boost::uint16_t next_id_;
+	// The calling thread's buffer and ring
+	boost::thread_specific_ptr<writer> writers_;
+};
+
+#endif
@@ -0,0 +1,365 @@
+//
+// session_bench.cc
+// ~~~~~~~~~~~~~~~~
+//
+// Microbenchmarks of the spreadsheet session's internals: loading an xml file, serializing
+// the cells for JOIN OK, saving, compacting, committing a CHANGE and encoding an UPDATE for
+// many users.
+// Sessions run in process with local connections instead of sockets, on io_services this
+// thread polls, so nothing but the work being measured runs.  Takes Google Benchmark's
+// arguments; "make session_bench" runs it and writes session_bench.json, and two such files
+// from different builds can be compared with Google Benchmark's tools/compare.py.
+//
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include "spreadsheet_session.h"
+#include "tcp_connection.h"
+#include "cell_store.h"
+#include "change_journal.h"
+#include "server_log.h"
+
+/*
+*	The benchmarks, and the io_services and pool every session they open shares.  They drive a
+*	session through its public calls that must run on the strand, which is safe because
+*	everything runs on the benchmark's thread: after each step the io_services are polled until
+*	neither has work left.
+*/
+class session_bench
+{
+public:
+	static void open_file(benchmark::State& state)
+	{
+		std::size_t count = state.range(0);
+		std::string path = xml_file(count);
+		while(state.KeepRunning())
+		{
+			state.PauseTiming();
+			tcp_connection::pointer user;
+			spreadsheet_session::pointer session = open_session(0, user);
+			state.ResumeTiming();
+
+			session->read_xml_file(path);
+
+			state.PauseTiming();
+			if(session->cell_count() != count)
+				state.SkipWithError("open_file loaded the wrong number of cells");
+			close_session(session);
+			state.ResumeTiming();
+		}
+		state.SetItemsProcessed(state.iterations() * count);
+	}
+
+	/*
+	*	The xml sent with JOIN OK.  Serialized from the cells in place on the strand.
+	*/
+	static void get_current_state(benchmark::State& state)
+	{
+		tcp_connection::pointer user;
+		spreadsheet_session::pointer session = open_session(state.range(0), user);
+		std::size_t bytes = 0;
+		while(state.KeepRunning())
+		{
+			std::string xml = session->get_current_state();
+			bytes += xml.size();
+			benchmark::DoNotOptimize(xml.data());
+		}
+		state.SetBytesProcessed(bytes);
+		close_session(session);
+	}
+
+	/*
+	*	A SAVE after one CHANGE: syncing the journal on the background thread and answering.
+	*	Should not depend on the size of the sheet.
+	*/
+	static void save_ss(benchmark::State& state)
+	{
+		tcp_connection::pointer user;
+		spreadsheet_session::pointer session = open_session(state.range(0), user);
+		spreadsheet_session::session_command command;
+		command.type = spreadsheet_session::session_command::change;
+		command.connection = user;
+		command.name = session->name();
+		command.cell = "A1";
+		command.contents = "1";
+		spreadsheet_session::session_command save;
+		save.type = spreadsheet_session::session_command::save;
+		save.connection = user;
+		save.name = session->name();
+		while(state.KeepRunning())
+		{
+			state.PauseTiming();
+			command.version = session->version();
+			session->apply(command);
+			state.ResumeTiming();
+
+			session->apply(save);
+			drain();
+		}
+		state.SetItemsProcessed(state.iterations());
+		close_session(session);
+	}
+
+	/*
+	*	Folding the journal into the sheet file: copying the cells, encoding and writing the
+	*	sheet file with its sync, and starting the journal over.
+	*/
+	static void compact(benchmark::State& state)
+	{
+		tcp_connection::pointer user;
+		spreadsheet_session::pointer session = open_session(state.range(0), user);
+		while(state.KeepRunning())
+		{
+			session->compact();
+			drain();
+		}
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+		close_session(session);
+	}
+
+	/*
+	*	Committing CHANGEs of numbers to cells that already exist, each against the current
+	*	version: the cell store, undo log, journal append and CHANGE OK.  Nobody else is in the
+	*	session, so no UPDATE is sent.
+	*/
+	static void change_commit(benchmark::State& state)
+	{
+		std::size_t count = state.range(0);
+		tcp_connection::pointer user;
+		spreadsheet_session::pointer session = open_session(count, user);
+
+		std::vector<spreadsheet_session::session_command> commands(1024);
+		for(std::size_t i = 0; i < commands.size(); i++)
+		{
+			std::ostringstream contents;
+			contents << i * 7;
+			commands[i].type = spreadsheet_session::session_command::change;
+			commands[i].connection = user;
+			commands[i].name = session->name();
+			commands[i].cell = cell_name(i * 7919 % count);
+			commands[i].contents = contents.str();
+		}
+
+		std::size_t next = 0;
+		while(state.KeepRunning())
+		{
+			spreadsheet_session::session_command& command = commands[next++ % commands.size()];
+			command.version = session->version();
+			session->apply(command);
+		}
+		state.SetItemsProcessed(state.iterations());
+		close_session(session);
+	}
+
+	/*
+	*	Committing a CHANGE in a session of several users: on top of change_commit, encoding one
+	*	UPDATE and queueing it for every user but the sender.
+	*/
+	static void send_update(benchmark::State& state)
+	{
+		int users = state.range(0);
+		tcp_connection::pointer sender;
+		spreadsheet_session::pointer session = open_session(1000, sender);
+		std::vector<tcp_connection::pointer> others;
+		for(int i = 1; i < users; i++)
+		{
+			others.push_back(local_user());
+			session->join(others.back());
+		}
+		drain();
+
+		spreadsheet_session::session_command command;
+		command.type = spreadsheet_session::session_command::change;
+		command.connection = sender;
+		command.name = session->name();
+		command.cell = "A1";
+		command.contents = "12345";
+		while(state.KeepRunning())
+		{
+			command.version = session->version();
+			session->apply(command);
+		}
+		state.SetItemsProcessed(state.iterations() * (users - 1));
+		close_session(session);
+	}
+
+	/*
+	*	Messages delivered to local users so far, so the work of delivering them is not skipped.
+	*/
+	static boost::atomic<unsigned long> delivered;
+
+	/*
+	*	The directory the sessions' files are written to, kept out of the real ones.
+	*/
+	static const char* const scratch;
+
+private:
+	/*
+	*	Opens a session on a spreadsheet of count cells with one local user, and runs it until
+	*	it has loaded.  The first time each size is opened its xml file is written and the
+	*	session converts it to a sheet file; later sessions load the sheet file.
+	*/
+	static spreadsheet_session::pointer open_session(std::size_t count, tcp_connection::pointer& user)
+	{
+		user = local_user();
+		std::string xml = xml_file(count);
+		spreadsheet_session::pointer session = spreadsheet_session::create(io_service(), background(), recalc(),
+			std::size_t(16) << 20, "bench" + xml, xml, user);
+		drain();
+		return session;
+	}
+
+	/*
+	*	Lets the session finish what it started, then drops it.  Its files are kept for the
+	*	next session of the same size.
+	*/
+	static void close_session(spreadsheet_session::pointer& session)
+	{
+		drain();
+		session.reset();
+	}
+
+	static tcp_connection::pointer local_user()
+	{
+		return tcp_connection::create_local(io_service(), &session_bench::deliver);
+	}
+
+	static void deliver(tcp_connection::shared_message message)
+	{
+		delivered.fetch_add(message->size(), boost::memory_order_relaxed);
+	}
+
+	/*
+	*	Runs the session's strand and the background thread's work, including whatever either
+	*	hands the other, until both are idle.
+	*/
+	static void drain()
+	{
+		while(io_service().poll() + background().poll() > 0)
+			;
+	}
+
+	/*
+	*	The xml file of a spreadsheet of count cells, written the first time it is asked for: a
+	*	mix of numbers, formulas, text that needs escaping and blanks.
+	*/
+	static std::string xml_file(std::size_t count)
+	{
+		std::ostringstream name;
+		name << scratch << "/cells" << count << ".xml";
+		std::string path = name.str();
+		struct stat info;
+		if(::stat(path.c_str(), &info) == 0)
+			return path;
+
+		cell_store cells;
+		for(std::size_t i = 0; i < count; i++)
+		{
+			std::ostringstream contents;
+			switch(i % 4)
+			{
+			case 0: contents << i * 0.5; break;
+			case 1: contents << "=A" << i / 26 + 1 << "+" << i; break;
+			case 2: contents << "item <" << i << "> & \"more\""; break;
+			default: contents << "   "; break;
+			}
+			cell_key key;
+			cell_store::parse_name(cell_name(i), key);
+			cells.set(cells.intern(key), contents.str());
+		}
+		change_journal::write_file(path, spreadsheet_session::to_xml(cells, true));
+		return path;
+	}
+
+	static std::string cell_name(std::size_t i)
+	{
+		std::ostringstream name;
+		name << static_cast<char>('A' + i % 26) << i / 26 + 1;
+		return name.str();
+	}
+
+	static boost::asio::io_service& io_service()
+	{
+		static boost::asio::io_service service;
+		static boost::asio::io_service::work work(service);
+		return service;
+	}
+
+	static boost::asio::io_service& background()
+	{
+		static boost::asio::io_service service;
+		static boost::asio::io_service::work work(service);
+		return service;
+	}
+
+	static recalc_pool& recalc()
+	{
+		static recalc_pool pool(0);
+		return pool;
+	}
+};
+
+boost::atomic<unsigned long> session_bench::delivered(0);
+const char* const session_bench::scratch = "session_bench.tmp";
+
+/*
+*	Removes the files a run left in directory, then the directory.
+*/
+static void remove_directory(const std::string& path)
+{
+	DIR* dir = ::opendir(path.c_str());
+	if(dir == NULL)
+		return;
+	while(dirent* file = ::readdir(dir))
+	{
+		std::string name = file->d_name;
+		if(name != "." && name != "..")
+			::unlink((path + "/" + name).c_str());
+	}
+	::closedir(dir);
+	::rmdir(path.c_str());
+}
+
+int main(int argc, char* argv[])
+{
+	benchmark::Initialize(&argc, argv);
+	if(benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+
+	std::string scratch = session_bench::scratch;
+	remove_directory(scratch);
+	if(::mkdir(scratch.c_str(), 0755) != 0)
+	{
+		std::perror(scratch.c_str());
+		return 1;
+	}
+	server_log::instance().start(scratch + "/session_bench.log");
+
+	benchmark::RegisterBenchmark("open_file", &session_bench::open_file)
+		->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMillisecond);
+	benchmark::RegisterBenchmark("get_current_state", &session_bench::get_current_state)
+		->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+	benchmark::RegisterBenchmark("save_ss", &session_bench::save_ss)
+		->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+	benchmark::RegisterBenchmark("compact", &session_bench::compact)
+		->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+	benchmark::RegisterBenchmark("change_commit", &session_bench::change_commit)
+		->Arg(1000)->Arg(100000)->Unit(benchmark::kMicrosecond);
+	benchmark::RegisterBenchmark("send_update", &session_bench::send_update)
+		->Arg(2)->Arg(10)->Arg(100)->Arg(1000)->Unit(benchmark::kMicrosecond);
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	server_log::instance().stop();
+	remove_directory(scratch);
+	return 0;
+}
@@ -0,0 +1,151 @@
+//
+// session_manager.h
+// ~~~~~~~~~~~~~~~~~
+//
+// Keeps the loaded spreadsheet sessions, loading them on JOIN and unloading them when idle.
+//
+
+#ifndef SESSION_MANAGER_H
+#define SESSION_MANAGER_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include "spreadsheet_session.h"
+#include "tcp_connection.h"
+#include "recalc_pool.h"
+#include "server_log.h"
+#include "metrics.h"
+
+/*
+*	The session_manager holds one reference to every loaded session, by xml file, and is the
+*	only place sessions are created or dropped, so a spreadsheet never has two sessions.
+*
+*	A session is idle once its last user has left and its sheet file holds every change.  Once
+*	a second the manager unloads the sessions that have been idle for idle_timeout, and, while
+*	the loaded sessions together hold more than memory_budget, the least recently used idle
+*	ones before that.  Sessions in use are never unloaded, however far over the budget they go.
+*
+*	An unloaded session's journal is empty, so when someone joins it again it is loaded back
+*	with one mapped read of its sheet file: no journal replay and no xml.
+*/
+class session_manager
+{
+public:
+	enum { sweep_interval_ms = 1000 };
+
+	session_manager(boost::asio::io_service& io_service, boost::asio::io_service& background, recalc_pool& recalc,
+		std::size_t undo_limit, boost::uint64_t idle_timeout_us, std::size_t memory_budget)
+		: io_service_(io_service), background_(background), recalc_(recalc), undo_limit_(undo_limit),
+		  idle_timeout_(idle_timeout_us), memory_budget_(memory_budget), over_budget_(false), timer_(io_service)
+	{
+		schedule_sweep();
+	}
+
+	/*
+	*	Adds the connection to the session of xml_file, loading it first if it is not loaded.
+	*/
+	void join(const std::string& name, const std::string& xml_file, tcp_connection::pointer connection)
+	{
+		//held across the lookup and insert so a sheet never gets two sessions, and so a sweep
+		//never unloads a session between finding it and joining it
+		boost::mutex::scoped_lock lock(mtx_);
+		std::map<std::string, spreadsheet_session::pointer>::iterator it = sessions_.find(xml_file);
+		if(it != sessions_.end())
+		{
+			it->second->join(connection);
+			return;
+		}
+
+		server_metrics::instance().add(server_metrics::sessions_loaded);
+		sessions_.insert(std::make_pair(xml_file, spreadsheet_session::create(io_service_, background_, recalc_,
+			undo_limit_, name, xml_file, connection)));
+	}
+
+private:
+	void schedule_sweep()
+	{
+		timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(sweep_interval_ms)));
+		timer_.async_wait(boost::bind(&session_manager::sweep, this, boost::asio::placeholders::error));
+	}
+
+	/*
+	*	Unloads the idle sessions that are past idle_timeout or, oldest first, over the budget.
+	*/
+	void sweep(const boost::system::error_code& error_code)
+	{
+		if(error_code)
+			return;
+
+		//destroyed after the lock is released
+		std::vector<spreadsheet_session::pointer> unloaded;
+		std::size_t memory = 0, loaded = 0;
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			std::vector<std::pair<boost::uint64_t, std::string> > idle;
+			std::map<std::string, spreadsheet_session::pointer>::iterator it;
+			for(it = sessions_.begin(); it != sessions_.end(); it++)
+			{
+				memory += it->second->memory_usage();
+				boost::uint64_t idle_since;
+				if(it->second->idle(idle_since))
+					idle.push_back(std::make_pair(idle_since, it->first));
+			}
+			std::sort(idle.begin(), idle.end());
+
+			boost::uint64_t now = server_metrics::now();
+			for(std::size_t i = 0; i < idle.size(); i++)
+			{
+				if(now - idle[i].first < idle_timeout_ && memory <= memory_budget_)
+					break;
+				it = sessions_.find(idle[i].second);
+				memory -= std::min(memory, it->second->memory_usage());
+				unloaded.push_back(it->second);
+				sessions_.erase(it);
+			}
+			loaded = sessions_.size();
+		}
+
+		for(std::size_t i = 0; i < unloaded.size(); i++)
+		{
+			LOG_INFO("Unloading idle SS Session: " << unloaded[i]->name() << " (" << unloaded[i]->memory_usage()
+				<< " bytes)");
+			server_metrics::instance().add(server_metrics::sessions_unloaded);
+		}
+		if(!unloaded.empty())
+			LOG_INFO(loaded << " sessions loaded, holding about " << memory << " bytes.");
+		bool over_budget = memory > memory_budget_;
+		if(over_budget && !over_budget_)
+			LOG_WARN("Sessions in use hold about " << memory << " bytes, over the budget of " << memory_budget_ << ".");
+		over_budget_ = over_budget;
+
+		schedule_sweep();
+	}
+
+	boost::asio::io_service& io_service_;
+	//runs the sessions' slow file work
+	boost::asio::io_service& background_;
+	//shared by the sessions for large recalculations
+	recalc_pool& recalc_;
+	//the memory each session's undo log may use, in bytes
+	std::size_t undo_limit_;
+	//how long a session stays loaded once idle, in microseconds
+	boost::uint64_t idle_timeout_;
+	//the memory the loaded sessions may hold before idle ones are unloaded early, in bytes
+	std::size_t memory_budget_;
+	//whether the last sweep found the budget exceeded, so it is only reported once
+	bool over_budget_;
+	//guards sessions_, JOINs and sweeps run on several threads
+	boost::mutex mtx_;
+	//every loaded session, by xml file
+	std::map<std::string, spreadsheet_session::pointer> sessions_;
+	boost::asio::deadline_timer timer_;
+};
+
+#endif
@@ -0,0 +1,218 @@
+//
+// sheet_file.h
+// ~~~~~~~~~~~~
+//
+// The binary file format the server keeps spreadsheets in.
+//
+
+#ifndef SHEET_FILE_H
+#define SHEET_FILE_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "cell_store.h"
+
+/*
+*	A sheet file holds the cells of one spreadsheet, laid out in host byte order as
+*
+*	header (44 bytes)
+*	magic          8 bytes  "SHEETBIN"
+*	version        u32      format_version
+*	cell count     u32
+*	string count   u32
+*	reserved       u32      0
+*	content bytes  u64      size of the content block
+*	index crc      u32      crc32 of the cell index and the string lengths
+*	content crc    u32      crc32 of the content block
+*	header crc     u32      crc32 of the 40 bytes before it
+*
+*	cell index     cell count entries of u64 cell_key, u32 string number, sorted by key
+*	string lengths string count u32 lengths
+*	content block  the strings, one after another
+*
+*	Contents are interned: cells with the same contents, which pasted and filled ranges have
+*	a lot of, share one string.  Each part has its own checksum, so a torn or corrupt file is
+*	rejected as a whole rather than loaded wrong.  A new format_version can change anything
+*	after the magic.
+*/
+class sheet_file
+{
+public:
+	enum { format_version = 1, header_size = 44, index_entry_size = 12 };
+
+	/*
+	*	Encodes every used cell.
+	*/
+	static std::string encode(const cell_store& cells)
+	{
+		//collect the cells in key order, then intern their contents by sorting a copy of them
+		std::vector<std::pair<cell_key, boost::string_ref> > sorted;
+		sorted.reserve(cells.size());
+		cells.for_each_sorted(boost::bind(&sheet_file::collect, boost::ref(sorted), _1, _2));
+
+		std::vector<std::pair<boost::string_ref, boost::uint32_t> > by_contents(sorted.size());
+		for(std::size_t i = 0; i < sorted.size(); i++)
+			by_contents[i] = std::make_pair(sorted[i].second, static_cast<boost::uint32_t>(i));
+		std::sort(by_contents.begin(), by_contents.end());
+
+		std::vector<boost::uint32_t> string_of(sorted.size());
+		std::vector<boost::string_ref> strings;
+		boost::uint64_t content_bytes = 0;
+		for(std::size_t i = 0; i < by_contents.size(); i++)
+		{
+			if(i == 0 || by_contents[i].first != by_contents[i - 1].first)
+			{
+				strings.push_back(by_contents[i].first);
+				content_bytes += by_contents[i].first.size();
+			}
+			string_of[by_contents[i].second] = strings.size() - 1;
+		}
+
+		std::string out;
+		out.reserve(header_size + sorted.size() * index_entry_size + strings.size() * 4 + content_bytes);
+		out.resize(header_size);
+		for(std::size_t i = 0; i < sorted.size(); i++)
+		{
+			put(out, sorted[i].first);
+			put(out, string_of[i]);
+		}
+		for(std::size_t i = 0; i < strings.size(); i++)
+			put(out, static_cast<boost::uint32_t>(strings[i].size()));
+		std::size_t content_start = out.size();
+		for(std::size_t i = 0; i < strings.size(); i++)
+			out.append(strings[i].data(), strings[i].size());
+
+		char* header = &out[0];
+		std::memcpy(header, "SHEETBIN", 8);
+		write_u32(header + 8, format_version);
+		write_u32(header + 12, sorted.size());
+		write_u32(header + 16, strings.size());
+		write_u32(header + 20, 0);
+		std::memcpy(header + 24, &content_bytes, 8);
+		write_u32(header + 32, crc(out.data() + header_size, content_start - header_size));
+		write_u32(header + 36, crc(out.data() + content_start, content_bytes));
+		write_u32(header + 40, crc(header, 40));
+		return out;
+	}
+
+	/*
+	*	Checks a whole sheet file, then calls reserve(count, bytes) with the number of cells and
+	*	the size of their contents, and cell(key, contents) for every cell in key order.  The
+	*	contents are views into data.  Returns false, having called neither, and sets error if
+	*	data is not an intact sheet file.
+	*/
+	template <typename Reserve, typename Cell>
+	static bool decode(boost::string_ref data, Reserve reserve, Cell cell, std::string& error)
+	{
+		const char* bytes = data.data();
+		if(data.size() < header_size || std::memcmp(bytes, "SHEETBIN", 8) != 0)
+		{
+			error = "not a sheet file";
+			return false;
+		}
+		if(read_u32(bytes + 40) != crc(bytes, 40))
+		{
+			error = "header checksum mismatch";
+			return false;
+		}
+		if(read_u32(bytes + 8) != format_version)
+		{
+			error = "unknown format version";
+			return false;
+		}
+
+		boost::uint64_t cell_count = read_u32(bytes + 12);
+		boost::uint64_t string_count = read_u32(bytes + 16);
+		boost::uint64_t content_bytes;
+		std::memcpy(&content_bytes, bytes + 24, 8);
+		boost::uint64_t index_bytes = cell_count * index_entry_size + string_count * 4;
+		if(data.size() - header_size < index_bytes || data.size() - header_size - index_bytes != content_bytes)
+		{
+			error = "sizes do not match the file";
+			return false;
+		}
+		const char* index = bytes + header_size;
+		const char* lengths = index + cell_count * index_entry_size;
+		const char* content = index + index_bytes;
+		if(read_u32(bytes + 32) != crc(index, index_bytes) || read_u32(bytes + 36) != crc(content, content_bytes))
+		{
+			error = "content checksum mismatch";
+			return false;
+		}
+
+		//place every string and check the index against them
+		std::vector<boost::uint64_t> offsets(string_count + 1, 0);
+		for(std::size_t i = 0; i < string_count; i++)
+			offsets[i + 1] = offsets[i] + read_u32(lengths + i * 4);
+		if(offsets[string_count] != content_bytes)
+		{
+			error = "string lengths do not match the content block";
+			return false;
+		}
+		boost::uint64_t cell_bytes = 0;
+		cell_key previous = 0;
+		for(std::size_t i = 0; i < cell_count; i++)
+		{
+			cell_key key;
+			std::memcpy(&key, index + i * index_entry_size, 8);
+			boost::uint32_t string = read_u32(index + i * index_entry_size + 8);
+			if(string >= string_count || (i > 0 && key <= previous))
+			{
+				error = "cell index is corrupt";
+				return false;
+			}
+			cell_bytes += offsets[string + 1] - offsets[string];
+			previous = key;
+		}
+
+		reserve(cell_count, cell_bytes);
+		for(std::size_t i = 0; i < cell_count; i++)
+		{
+			cell_key key;
+			std::memcpy(&key, index + i * index_entry_size, 8);
+			boost::uint32_t string = read_u32(index + i * index_entry_size + 8);
+			cell(key, boost::string_ref(content + offsets[string], offsets[string + 1] - offsets[string]));
+		}
+		return true;
+	}
+
+private:
+	static void collect(std::vector<std::pair<cell_key, boost::string_ref> >& sorted, cell_key key, boost::string_ref contents)
+	{
+		sorted.push_back(std::make_pair(key, contents));
+	}
+
+	template <typename T>
+	static void put(std::string& out, T value)
+	{
+		out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	static void write_u32(char* out, boost::uint32_t value)
+	{
+		std::memcpy(out, &value, 4);
+	}
+
+	static boost::uint32_t read_u32(const char* in)
+	{
+		boost::uint32_t value;
+		std::memcpy(&value, in, 4);
+		return value;
+	}
+
+	static boost::uint32_t crc(const char* data, std::size_t size)
+	{
+		boost::crc_32_type result;
+		result.process_bytes(data, size);
+		return result.checksum();
+	}
+};
+
+#endif
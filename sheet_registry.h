@@ -0,0 +1,309 @@
+//
+// sheet_registry.h
+// ~~~~~~~~~~~~~~~~
+//
+// The on-disk index of every spreadsheet the server knows: its name, password and file.
+//
+
+#ifndef SHEET_REGISTRY_H
+#define SHEET_REGISTRY_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/thread/mutex.hpp>
+#include "change_journal.h"
+#include "server_log.h"
+
+/*
+*	The sheet_registry keeps one small entry file per spreadsheet in a directory, named after the
+*	spreadsheet and holding
+*
+*	password
+*	xml file
+*
+*	The directory is the index: finding a spreadsheet opens one entry file, which the file
+*	system looks up by name, so opening the registry reads nothing and an entry is only read the
+*	first time its spreadsheet is asked for.  Entries that were read are kept in memory.
+*
+*	Creating a spreadsheet first reserves its file number by creating xml<n>.xml exclusively,
+*	which no two creators, even in different processes, can both do.  The entry is then written
+*	and synced under a temporary name and hard linked to its real name, which fails if the name
+*	is taken, so the entry appears whole or not at all and two CREATEs of one name cannot both
+*	succeed.  A crash part way leaves at most an unused xml file behind.
+*
+*	The first time the server runs with a registry, the older spreadsheet_files.txt list is
+*	imported into it.
+*/
+class sheet_registry
+{
+public:
+	struct entry
+	{
+		std::string password;
+		std::string xml_file;
+	};
+
+	enum create_result { created, exists, failed };
+
+	explicit sheet_registry(const std::string& directory)
+		: directory_(directory), next_id_(1)
+	{
+	}
+
+	/*
+	*	Opens the registry, creating it from the spreadsheet list at legacy_list if there is no
+	*	registry yet.  Returns false if neither can be done.
+	*/
+	bool open(const std::string& legacy_list)
+	{
+		struct stat info;
+		if(::stat(directory_.c_str(), &info) != 0)
+		{
+			if(!import(legacy_list))
+				return false;
+		}
+		else if(!S_ISDIR(info.st_mode))
+			return false;
+
+		//only a hint, reserve() never hands out a number that is in use
+		std::ifstream in((directory_ + "/next_id").c_str());
+		unsigned long id;
+		if(in >> id && id > 0)
+			next_id_ = id;
+		return true;
+	}
+
+	/*
+	*	Looks up the spreadsheet called name.  Returns false if there is none.
+	*/
+	bool find(const std::string& name, entry& found)
+	{
+		{
+			boost::mutex::scoped_lock lock(mtx_);
+			std::map<std::string, entry>::iterator it = entries_.find(name);
+			if(it != entries_.end())
+			{
+				found = it->second;
+				return true;
+			}
+		}
+
+		std::string path;
+		if(!entry_path(name, path))
+			return false;
+		std::ifstream in(path.c_str());
+		if(!std::getline(in, found.password) || !std::getline(in, found.xml_file) || found.xml_file.empty())
+			return false;
+
+		boost::mutex::scoped_lock lock(mtx_);
+		entries_.insert(std::make_pair(name, found));
+		return true;
+	}
+
+	/*
+	*	Registers a new, empty spreadsheet called name.  made receives its entry.
+	*/
+	create_result create(const std::string& name, const std::string& password, entry& made)
+	{
+		std::string path;
+		if(!entry_path(name, path))
+			return failed;
+		if(find(name, made))
+			return exists;
+
+		boost::mutex::scoped_lock lock(create_mtx_);
+		unsigned long id;
+		if(!reserve(id))
+			return failed;
+		std::ostringstream number;
+		number << id;
+		made.password = password;
+		made.xml_file = "xml" + number.str() + ".xml";
+
+		std::string temp = directory_ + "/.new" + number.str();
+		if(!write_entry(temp, made))
+		{
+			::unlink(made.xml_file.c_str());
+			return failed;
+		}
+		int linked = ::link(temp.c_str(), path.c_str());
+		int error = errno;
+		::unlink(temp.c_str());
+		if(linked != 0)
+		{
+			::unlink(made.xml_file.c_str());
+			return error == EEXIST ? exists : failed;
+		}
+		change_journal::sync_directory(path);
+
+		std::ofstream hint((directory_ + "/next_id").c_str());
+		hint << id + 1 << std::endl;
+
+		boost::mutex::scoped_lock entries_lock(mtx_);
+		entries_.insert(std::make_pair(name, made));
+		return created;
+	}
+
+private:
+	/*
+	*	The entry file for name.  Characters other than letters, digits, - and _ are written as
+	*	%xx so any name makes a valid file name.  Returns false for a name too long for one.
+	*/
+	bool entry_path(const std::string& name, std::string& path) const
+	{
+		static const char hex[] = "0123456789abcdef";
+		std::string file = "s_";
+		for(std::string::size_type i = 0; i < name.size(); i++)
+		{
+			unsigned char c = name[i];
+			if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')
+				file += c;
+			else
+			{
+				file += '%';
+				file += hex[c >> 4];
+				file += hex[c & 15];
+			}
+		}
+		if(file.size() > 250)
+			return false;
+		path = directory_ + "/" + file;
+		return true;
+	}
+
+	/*
+	*	Takes the next free file number by creating its xml file, empty, exclusively.  A number
+	*	whose sheet file or journal is still around is skipped so a new spreadsheet never picks
+	*	up an old one's cells.
+	*/
+	bool reserve(unsigned long& id)
+	{
+		static const char empty[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n<spreadsheet>\r\n</spreadsheet>";
+		for(;; next_id_++)
+		{
+			std::ostringstream number;
+			number << next_id_;
+			std::string xml_file = "xml" + number.str() + ".xml";
+			int fd = ::open(xml_file.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if(fd < 0)
+			{
+				if(errno == EEXIST)
+					continue;
+				return false;
+			}
+			struct stat info;
+			if(::stat(("xml" + number.str() + ".sheet").c_str(), &info) == 0 ||
+				::stat((xml_file + ".journal").c_str(), &info) == 0)
+			{
+				::close(fd);
+				::unlink(xml_file.c_str());
+				continue;
+			}
+			bool written = change_journal::write_all(fd, empty, sizeof(empty) - 1) && ::fsync(fd) == 0;
+			::close(fd);
+			if(!written)
+			{
+				::unlink(xml_file.c_str());
+				return false;
+			}
+			change_journal::sync_directory(xml_file);
+			id = next_id_++;
+			return true;
+		}
+	}
+
+	static bool write_entry(const std::string& path, const entry& e)
+	{
+		std::string data = e.password + "\n" + e.xml_file + "\n";
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0)
+			return false;
+		bool written = change_journal::write_all(fd, data.data(), data.size()) && ::fsync(fd) == 0;
+		::close(fd);
+		if(!written)
+			::unlink(path.c_str());
+		return written;
+	}
+
+	/*
+	*	Builds the registry from the older list, in which each spreadsheet is a blank line, its
+	*	name, its password and its xml file.  The entries are written to a temporary directory
+	*	that is renamed into place once they are all on disk.
+	*/
+	bool import(const std::string& legacy_list)
+	{
+		std::string temp = directory_ + ".tmp";
+		remove_directory(temp);
+		if(::mkdir(temp.c_str(), 0755) != 0)
+			return false;
+
+		LOG_INFO("Importing " << legacy_list << " into " << directory_ << ".");
+		sheet_registry imported(temp);
+		std::ifstream in(legacy_list.c_str());
+		std::string line, name;
+		unsigned long count = 0, next = 1;
+		while(std::getline(in, line))
+		{
+			entry e;
+			if(!std::getline(in, name) || !std::getline(in, e.password) || !std::getline(in, e.xml_file))
+				break;
+			std::string path;
+			if(!imported.entry_path(name, path) || !write_entry(path, e))
+			{
+				LOG_WARN("Could not import spreadsheet " << name << ".");
+				continue;
+			}
+			count++;
+			unsigned long id = std::strtoul(e.xml_file.c_str() + (e.xml_file.compare(0, 3, "xml") == 0 ? 3 : 0), NULL, 10);
+			if(id >= next)
+				next = id + 1;
+		}
+		std::ofstream hint((temp + "/next_id").c_str());
+		hint << next << std::endl;
+		hint.close();
+
+		//every entry file was synced as it was written, syncing the directory makes their names
+		//durable before the rename puts them in place
+		change_journal::sync_directory(temp + "/");
+		if(::rename(temp.c_str(), directory_.c_str()) != 0)
+			return false;
+		change_journal::sync_directory(directory_);
+		LOG_INFO("Imported " << count << " spreadsheets.");
+		return true;
+	}
+
+	static void remove_directory(const std::string& path)
+	{
+		DIR* dir = ::opendir(path.c_str());
+		if(dir == NULL)
+			return;
+		while(dirent* file = ::readdir(dir))
+		{
+			std::string name = file->d_name;
+			if(name != "." && name != "..")
+				::unlink((path + "/" + name).c_str());
+		}
+		::closedir(dir);
+		::rmdir(path.c_str());
+	}
+
+	std::string directory_;
+	// Guards entries_
+	boost::mutex mtx_;
+	// The entries read so far, by spreadsheet name
+	std::map<std::string, entry> entries_;
+	// Serializes CREATEs within the process; the file system does it between processes
+	boost::mutex create_mtx_;
+	unsigned long next_id_;
+};
+
+#endif
@@ -0,0 +1,1777 @@
+//
+// spreadsheet_session.h
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// One open spreadsheet: its cells, the users editing it, and the commands they send.
+//
+
+#ifndef SPREADSHEET_SESSION_H
+#define SPREADSHEET_SESSION_H
+
+#include <cstdio>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <set>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/xml_parser.hpp>
+#include <boost/foreach.hpp>
+#include <boost/atomic.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include "tcp_connection.h"
+#include "message_buffer.h"
+#include "change_journal.h"
+#include "cell_store.h"
+#include "formula.h"
+#include "dependency_graph.h"
+#include "recalc_pool.h"
+#include "column_cache.h"
+#include "undo_log.h"
+#include "xml_loader.h"
+#include "sheet_file.h"
+#include "server_log.h"
+#include "metrics.h"
+
+/*
+*	An immutable copy of a spreadsheet's cells at one version.  A session takes one when it
+*	compacts and never modifies it afterwards, so the background thread can write it to the
+*	sheet file without locks while the session keeps committing changes.
+*/
+struct sheet_snapshot
+{
+	sheet_snapshot(const cell_store& cells, int version)
+		: cells(cells), version(version)
+	{
+	}
+
+	const cell_store cells;
+	const int version;
+};
+
+
+	/*
+	* The spreadsheet session represents a spreadsheet session on the server.
+	* Once a connection is created on the server,and the client joins a session, then
+	* a sessoin is created on the server.  When a client makes a change to the spreadsheet,
+	* the session will verify the change is valid, and then send the changes to every one else.
+	* The session verifies the the client is updating a correct version.  The spreadsheet session
+	* will take mutliple clients, updates from each clients, it will allow clients to do an update
+	* as well as save.  The session is saved when a client sends the save command or when there are 
+	* zero clients on the session.
+	*
+	* Sessions are reference counted.  The session_manager holds one reference for as long as the
+	* spreadsheet is loaded, and every handler queued on the strand or the background thread
+	* holds another, so a session lives until its last handler has run.  Connections only hold
+	* weak references; a message for a session that is gone is dropped.
+	*
+	* Once the last user has left and everything is saved the session reports itself idle, and
+	* the session_manager may unload it.
+	*/
+class spreadsheet_session
+  : public boost::enable_shared_from_this<spreadsheet_session>
+{
+public:	
+	typedef boost::shared_ptr<spreadsheet_session> pointer;
+
+	/* Assumes user has already been authenticated. Assumes there are no duplicate 
+	* spreadsheet_sessions with the same filename open. Once the file conneciton is complete
+	* Every handler of the session runs through its strand, so the session's state is only
+	* ever touched by one io_service thread at a time.
+	*/
+	static pointer create(boost::asio::io_service& io_service, boost::asio::io_service& background,
+		recalc_pool& recalc, std::size_t undo_limit, std::string file, std::string xml_file, tcp_connection::pointer user)
+	{
+		pointer session(new spreadsheet_session(io_service, background, recalc, undo_limit, file, xml_file));
+
+		//Attempt to open the filename, queued ahead of the first user on the strand
+		session->strand_.post(boost::bind(&spreadsheet_session::load, session));
+
+		//Add user to list
+		session->join(user);
+		return session;
+	}
+	
+	~spreadsheet_session()
+	{
+		LOG_INFO("Destroying SS Session: " << this->filename);
+	}
+
+	/* Queues the user to be added to the session and makes the session the owner of the
+	* connection's read loop.  Called from the server's handler for the user's JOIN, with the
+	* session_manager's lock held, so the manager never sees the session idle once a user is on
+	* the way.
+	*/
+	void join(tcp_connection::pointer connection)
+	{
+		this->joining_++;
+		boost::weak_ptr<spreadsheet_session> session = shared_from_this();
+		strand_.post(boost::bind(&spreadsheet_session::add_user, shared_from_this(), connection));
+		connection->hand_off(&strand_,
+			boost::bind(&spreadsheet_session::forward_message, session, _1, _2),
+			boost::bind(&spreadsheet_session::forward_error, session, _1, _2));
+	}
+
+	/* True, and sets idle_since to when it went idle, if the session has no users, none on the
+	* way and nothing unsaved, so it can be unloaded and loaded again from its sheet file alone.
+	* Safe to call from any thread.
+	*/
+	bool idle(boost::uint64_t& idle_since) const
+	{
+		idle_since = this->idle_since_.load(boost::memory_order_acquire);
+		return idle_since != 0 && this->joining_.load(boost::memory_order_acquire) == 0;
+	}
+
+	/* An estimate of the memory the session holds, in bytes, as of its last command.  Safe to
+	* call from any thread.
+	*/
+	std::size_t memory_usage() const
+	{
+		return this->gauges_->memory.load(boost::memory_order_relaxed);
+	}
+
+	const std::string& name() const
+	{
+		return this->filename;
+	}
+
+	/*
+	*	One decoded client request.  Holds copies of the fields it needs, so it stays valid
+	*	after the message it came from is gone.
+	*/
+	struct session_command
+	{
+		enum kind { change, batch, undo, save, leave, value, aggregate, unknown };
+
+		kind type;
+		tcp_connection::pointer connection;
+		std::string name;
+		int version;
+		int count;
+		std::string cell;
+		std::string contents;
+		std::string function;
+		std::string range;
+	};
+
+	/*
+	*	Applies one command.  Must run on the strand.
+	*/
+	void apply(const session_command& command)
+	{
+		switch(command.type)
+		{
+		case session_command::change:
+			apply_change(command);
+			break;
+		case session_command::batch:
+			apply_batch_change(command);
+			break;
+		case session_command::undo:
+			apply_undo(command);
+			break;
+		case session_command::save:
+			apply_save(command);
+			break;
+		case session_command::leave:
+			LOG_DEBUG("In LEAVE command");
+			remove_user(command.connection);
+			break;
+		case session_command::value:
+			apply_value(command);
+			break;
+		case session_command::aggregate:
+			apply_range(command);
+			break;
+		default:
+			LOG_DEBUG("In ERROR command");
+			//send ERROR command
+			send_message(command.connection, "ERROR\n");
+			break;
+		}
+		update_gauges();
+	}
+
+	/*
+	*	Reads the cells of an xml file, as load() does for a spreadsheet without a sheet file.
+	*	Must run on the strand.
+	*/
+	void read_xml_file(const std::string& path)
+	{
+		open_file(path);
+	}
+
+	/*
+	*	The current version and number of cells.  Must run on the strand.
+	*/
+	int version() const
+	{
+		return this->ss_version;
+	}
+
+	std::size_t cell_count() const
+	{
+		return this->cells.size();
+	}
+
+	/*
+	*	The get_current_method get's the current state of the session.  It puts it in the xml format
+	*	to prepare to send to the user.  The xml format is return in a string.  The string contains the
+	*	xml header is on the first line and the remaining of the xml format is on the  next line
+	*/
+	std::string get_current_state()
+	{
+		latency_timer timer(server_metrics::current_state_latency);
+		LOG_DEBUG("Creating current SS data for SS Session: " << filename);
+
+		//runs on the strand, so the cells are read in place rather than copied
+		this->cells.sort();
+		return to_xml(this->cells, false);
+	}
+
+	/* Folds the journal into the sheet file: an immutable snapshot of the cells is written to
+	* the sheet file on the background thread, which writes a temporary file, syncs it and
+	* renames it over the old one, then starts the journal over.  Done when the last user
+	* leaves and when an xml file is converted, so a session is loaded from its sheet file alone.
+	*/
+	void compact()
+	{
+		this->compact_requested_ = true;
+		save_ss();
+	}
+
+	/* Serializes the cells to xml, in the layout JOIN OK sends and xml files were saved in.
+	*/
+	static std::string to_xml(const cell_store& cells, bool indent)
+	{
+		using boost::property_tree::ptree;
+		ptree pt;
+
+		//read through the cells in order adding each to the property tree
+		if(cells.size() == 0)
+		{
+			pt.add("spreadsheet", NULL);
+		}
+		else
+			cells.for_each_sorted(boost::bind(&spreadsheet_session::add_xml_cell, boost::ref(pt), _1, _2));
+
+		std::ostringstream ss;
+		if(indent)
+			write_xml(ss, pt, boost::property_tree::xml_writer_make_settings<std::string>('\t', 1));
+		else
+			write_xml(ss, pt);
+		return ss.str();
+	}
+
+private:	
+	spreadsheet_session(boost::asio::io_service& io_service, boost::asio::io_service& background,
+		recalc_pool& recalc, std::size_t undo_limit, std::string file, std::string xml_file)
+		: recalc_(recalc), undo_(undo_limit), unsaved_changes(0), strand_(io_service), background_(background),
+		  writing_(false), compact_requested_(false), journal_lost_(false), writing_version_(-1), save_started_(0),
+		  gauges_(server_metrics::instance().add_session(file)), load_failed_(false), joining_(0), idle_since_(0)
+	{
+		LOG_INFO("-----Starting new Spreadsheet Session: " << file << "-----");
+
+		//Initialize member variables
+		this->filename = file;
+		this->xml_name = xml_file;
+		this->sheet_name = sheet_file_name(xml_file);
+		this->ss_version = 0;
+		this->user_count = 0;
+		this->join_snapshot_version = -1;
+	}
+
+	/* The read loop handlers given to the connections of the session.  They hold the session
+	* weakly, so a connection that outlives it cannot keep it loaded.
+	*/
+	static void forward_message(boost::weak_ptr<spreadsheet_session> session, tcp_connection::pointer connection,
+		const message& msg)
+	{
+		if(pointer s = session.lock())
+			s->message_received(connection, msg);
+	}
+
+	static void forward_error(boost::weak_ptr<spreadsheet_session> session, tcp_connection::pointer connection,
+		const boost::system::error_code& error_code)
+	{
+		if(pointer s = session.lock())
+			s->receive_error(connection, error_code);
+	}
+
+	/*
+	*	The (cell name, contents) pairs of one committed change, in the order they were applied.
+	*	A CHANGE is one pair, a BATCH CHANGE one pair per cell.
+	*/
+	typedef std::vector<change_journal::entry> change_set;
+
+	/*
+	*	A connection waiting for SAVE OK, and the spreadsheet name to answer it with.
+	*/
+	typedef std::pair<tcp_connection::pointer, std::string> save_waiter;
+
+	/*
+	*	One cell of a change being committed by commit_cells().  What the cell held before is
+	*	filled in as it is committed, so the change can be put back.
+	*/
+	struct cell_change
+	{
+		cell_key key;
+		std::string contents;
+		boost::shared_ptr<const formula> parsed;
+		std::string previous;
+		boost::shared_ptr<const formula> previous_formula;
+		cell_value previous_value;
+	};
+
+	/* Adds user to the list of connected users and sends the spreadsheets
+	* data to the user.
+	*/
+	void add_user(tcp_connection::pointer connection)
+	{
+		if(this->load_failed_)
+		{
+			//the connection's read loop belongs to the session, so it ends here too
+			this->joining_--;
+			send_message(connection, "JOIN FAIL\nName:" + this->filename + "\nCould not load the spreadsheet.\n");
+			connection->stop();
+			check_idle();
+			return;
+		}
+
+		latency_timer timer(server_metrics::join_latency);
+		server_metrics::instance().add(server_metrics::joins);
+		LOG_INFO("Adding user to SS Session: " << this->filename);
+
+		//Add to the list and increment count
+		this->connected_users.insert(connection);
+		this->user_count++;	
+		this->joining_--;
+		this->idle_since_.store(0, boost::memory_order_release);
+		//Send spreadsheet data to connection
+		send_XML(connection);
+		update_gauges();
+	}
+
+	/* Removes the user from the session.  Once no users are left the spreadsheet is saved.
+	* Safe to call more than once for the same connection.
+	*/
+	void remove_user(tcp_connection::pointer connection)
+	{
+		//remove connection from list and decrement count
+		if(this->connected_users.erase(connection) == 0)
+			return;
+		connection->stop();
+		this->user_count--;
+		update_gauges();
+		int temp_user_count = this->user_count;
+		int temp_change_sizes = this->unsaved_changes;
+		//If no users exist, save the session so it can be unloaded
+		if(temp_user_count == 0)
+		{
+			//Fold the journal into the sheet file while nobody is using the sheet
+			if(temp_change_sizes != 0 || this->journal_.size() != 0)
+				compact();
+			check_idle();
+		}
+	}
+
+	/* Marks the session idle once nobody is using it and the sheet file holds every change,
+	* with the journal empty, so unloading loses nothing and a reload is one read of the sheet
+	* file.  A session that failed to load holds nothing to save.  Called whenever a user leaves,
+	* a save finishes or a JOIN is refused.
+	*/
+	void check_idle()
+	{
+		if(this->user_count != 0)
+			return;
+		if(!this->load_failed_ && (this->writing_ || this->compact_requested_ || this->journal_lost_ ||
+			this->unsaved_changes != 0 || this->journal_.size() != 0 || !this->save_waiters_.empty()))
+			return;
+		if(this->idle_since_.load(boost::memory_order_relaxed) == 0)
+		{
+			LOG_INFO("SS Session is idle: " << this->filename);
+			this->idle_since_.store(server_metrics::now(), boost::memory_order_release);
+		}
+	}
+
+	/* Loads the spreadsheet from its sheet file and replays the changes journaled since the
+	* file was last written.  A spreadsheet that only has an xml file, one made by CREATE or
+	* by an older server, is read from the xml file and converted to a sheet file right away.
+	* A spreadsheet that cannot be read fails the session: every JOIN is answered JOIN FAIL,
+	* and the session goes idle so the manager unloads it.
+	*/
+	void load()
+	{
+		try
+		{
+			boost::uint64_t started = server_metrics::now();
+			bool converting = !open_sheet(this->sheet_name);
+			if(converting)
+				open_file(this->xml_name);
+			this->journal_.open(this->xml_name + ".journal",
+				boost::bind(&spreadsheet_session::apply_record, this, _1, _2));
+			rebuild_dependencies();
+			update_gauges();
+			boost::uint64_t elapsed = server_metrics::now() - started;
+			server_metrics::instance().record(server_metrics::load_latency, elapsed);
+			LOG_INFO("Loaded " << this->cells.size() << " cells in " << elapsed / 1000 << " ms for SS Session: "
+				<< this->filename);
+			if(converting)
+			{
+				LOG_INFO("Converting xml file to a sheet file in SS Session: " << this->filename);
+				compact();
+			}
+		}
+		catch(std::exception& e)
+		{
+			LOG_ERROR("Could not load SS Session: " << this->filename << ": " << e.what());
+			this->load_failed_ = true;
+		}
+	}
+
+	/* The sheet file kept next to an xml file: the same name ending in .sheet instead of .xml.
+	*/
+	static std::string sheet_file_name(const std::string& xml_file)
+	{
+		std::string::size_type dot = xml_file.rfind('.');
+		if(dot == std::string::npos || xml_file.compare(dot, std::string::npos, ".xml") != 0)
+			return xml_file + ".sheet";
+		return xml_file.substr(0, dot) + ".sheet";
+	}
+
+	/* Applies one journaled change while loading.  Empty contents clear the cell.
+	*/
+	void apply_record(const std::string& cellname, const std::string& contents)
+	{
+		cell_key key;
+		if(!cell_store::parse_name(cellname, key))
+		{
+			LOG_WARN("Skipping journaled change to invalid cell " << cellname << " in SS Session: " << this->filename);
+			return;
+		}
+		set_cell(this->cells.intern(key), contents);
+	}
+
+	/* Sets the contents of a cell and keeps its parsed formula up to date.  parsed is the
+	* already parsed formula when the caller validated the contents, otherwise the contents are
+	* parsed here.  Only the cell itself changes; the dependencies and the values of formulas
+	* are left to the caller.
+	*/
+	void set_cell(cell_store::cell_id id, boost::string_ref contents,
+		boost::shared_ptr<const formula> parsed = boost::shared_ptr<const formula>())
+	{
+		this->cells.set(id, contents);
+		grow_cell_state();
+
+		this->formulas[id].reset();
+		double number;
+		if(contents == "")
+			this->values[id] = cell_value();
+		else if(parse_number(contents, number))
+			this->values[id] = cell_value::make(cell_value::number, number);
+		else if(!is_formula(contents))
+			this->values[id] = cell_value::make(cell_value::text);
+		else if(parsed)
+			this->formulas[id] = parsed;
+		else
+		{
+			boost::shared_ptr<formula> f = boost::make_shared<formula>();
+			std::string error;
+			if(f->parse(contents, error))
+				this->formulas[id] = f;
+			else
+			{
+				//a bad formula that predates validation, it can only ever be an error
+				this->values[id] = cell_value::make(cell_value::error);
+			}
+		}
+		//formulas keep their old value here until they are recalculated
+		this->columns.set(this->cells.key(id), this->values[id]);
+	}
+
+	/* Sizes the per cell state for every cell id handed out so far.
+	*/
+	void grow_cell_state()
+	{
+		std::size_t count = this->cells.id_count();
+		if(this->formulas.size() >= count)
+			return;
+		this->formulas.resize(count);
+		this->values.resize(count);
+		this->graph.resize(count);
+		this->changed_at.resize(count, 0);
+	}
+
+	/* A change made against an older version does not conflict with anything if no commit
+	* since that version touched its cell: the client saw the contents the cell still has, so
+	* the change can be applied on top of the current version.  Versions more than
+	* rebase_window behind are too old to rebase.
+	*/
+	bool can_rebase(int version, cell_key key) const
+	{
+		if(version < 0 || version > this->ss_version || this->ss_version - version > rebase_window)
+			return false;
+		cell_store::cell_id id = this->cells.find(key);
+		return id == cell_store::npos || id >= this->changed_at.size() || this->changed_at[id] <= version;
+	}
+
+	/* Records that the cells were changed by the version just committed.
+	*/
+	void mark_changed(const std::vector<dependency_graph::node>& ids)
+	{
+		for(std::size_t i = 0; i < ids.size(); i++)
+			this->changed_at[ids[i]] = this->ss_version;
+	}
+
+	/* Fills ids with the cell ids the formula refers to, in the order of its references.
+	*/
+	void reference_ids(const formula* f, std::vector<dependency_graph::node>& ids)
+	{
+		ids.clear();
+		if(f != NULL)
+		{
+			const std::vector<cell_key>& references = f->references();
+			for(std::size_t i = 0; i < references.size(); i++)
+				ids.push_back(this->cells.intern(references[i]));
+		}
+		grow_cell_state();
+	}
+
+	/* Commits new contents for a cell: updates the cell, its dependencies, and the value of
+	* every formula that depends on it.  Returns false, changing nothing, if the contents are a
+	* formula that would depend on itself.  With force the contents are committed anyway, cut
+	* off from the cells they refer to, and the cell's value is a circular error.
+	*/
+	bool commit_cell(cell_store::cell_id id, const std::string& contents,
+		boost::shared_ptr<const formula> parsed = boost::shared_ptr<const formula>(), bool force = false)
+	{
+		if(!parsed && is_formula(contents))
+		{
+			boost::shared_ptr<formula> f = boost::make_shared<formula>();
+			std::string error;
+			if(f->parse(contents, error))
+				parsed = f;
+		}
+		reference_ids(parsed.get(), this->precedent_ids);
+
+		bool acyclic = this->graph.dependents_of(id, this->precedent_ids, this->recalc_order);
+		if(!acyclic && !force)
+			return false;
+
+		set_cell(id, contents, parsed);
+		if(acyclic)
+			this->graph.set_precedents(id, this->precedent_ids);
+		else
+		{
+			cut_circular(id);
+			this->graph.dependents_of(id, this->precedent_ids, this->recalc_order);
+		}
+		recalculate(this->recalc_order);
+		return true;
+	}
+
+	/* Cuts a cell that closes a loop off from the cells it refers to: it keeps its contents, but
+	* has no precedents and its value is a circular error.  Leaves precedent_ids empty.
+	*/
+	void cut_circular(cell_store::cell_id id)
+	{
+		LOG_WARN("Cell " << cell_store::name(this->cells.key(id)) << " is circular in SS Session: " << this->filename);
+		this->precedent_ids.clear();
+		this->graph.set_precedents(id, this->precedent_ids);
+		this->formulas[id].reset();
+		this->values[id] = cell_value::make(cell_value::error, 0, cell_value::circular);
+		this->columns.set(this->cells.key(id), this->values[id]);
+	}
+
+	/* Commits new contents for several cells as one change.  The cells are set in order, as if
+	* each were committed alone, but the formulas that depend on them are recalculated once at
+	* the end.  Returns the index of the first cell whose formula would depend on itself, having
+	* put every cell back as it was, or batch.size() once every cell is committed.  With force nothing is
+	* put back; a cell that would be circular is cut off as in commit_cell().
+	*/
+	std::size_t commit_cells(std::vector<cell_change>& batch, bool force)
+	{
+		this->batch_ids.clear();
+		for(std::size_t i = 0; i < batch.size(); i++)
+		{
+			cell_change& change = batch[i];
+			if(!change.parsed && is_formula(change.contents))
+			{
+				boost::shared_ptr<formula> f = boost::make_shared<formula>();
+				std::string error;
+				if(f->parse(change.contents, error))
+					change.parsed = f;
+			}
+			cell_store::cell_id id = this->cells.intern(change.key);
+			reference_ids(change.parsed.get(), this->precedent_ids);
+
+			//a cell that refers to nothing cannot close a loop, so a pasted block of numbers
+			//never walks the graph here
+			bool acyclic = this->precedent_ids.empty() ||
+				this->graph.dependents_of(id, this->precedent_ids, this->recalc_order);
+			if(!acyclic && !force)
+			{
+				//nothing was recalculated yet, so putting the cells back restores every value
+				for(std::size_t j = i; j-- > 0;)
+				{
+					cell_store::cell_id undone = this->batch_ids[j];
+					this->cells.set(undone, batch[j].previous);
+					this->formulas[undone] = batch[j].previous_formula;
+					this->values[undone] = batch[j].previous_value;
+					this->columns.set(batch[j].key, batch[j].previous_value);
+					reference_ids(batch[j].previous_formula.get(), this->precedent_ids);
+					this->graph.set_precedents(undone, this->precedent_ids);
+				}
+				return i;
+			}
+
+			change.previous = this->cells.contents(id).to_string();
+			change.previous_formula = this->formulas[id];
+			change.previous_value = this->values[id];
+			set_cell(id, change.contents, change.parsed);
+			if(acyclic)
+				this->graph.set_precedents(id, this->precedent_ids);
+			else
+				cut_circular(id);
+			this->batch_ids.push_back(id);
+		}
+
+		this->graph.dependents_of(this->batch_ids, this->recalc_order);
+		recalculate(this->recalc_order);
+		return batch.size();
+	}
+
+	/* Evaluates the formulas among the cells in order, which lists every cell after the cells
+	* it refers to.  Large recalculations are split into levels of cells that do not depend on
+	* each other, and each big level is spread over the recalc pool.  Every cell is evaluated
+	* exactly once from the values of the levels before it, so the results are the same however
+	* the work is split.
+	*/
+	void recalculate(const std::vector<dependency_graph::node>& order)
+	{
+		if(order.size() < parallel_threshold || this->recalc_.size() == 0)
+		{
+			evaluate_cells(order.empty() ? NULL : &order[0], 0, order.size());
+			return;
+		}
+
+		this->graph.levels(order, this->level_cells, this->level_starts);
+		for(std::size_t l = 0; l + 1 < this->level_starts.size(); l++)
+		{
+			const dependency_graph::node* level = &this->level_cells[0] + this->level_starts[l];
+			std::size_t count = this->level_starts[l + 1] - this->level_starts[l];
+			if(count < parallel_threshold)
+				evaluate_cells(level, 0, count);
+			else
+				this->recalc_.parallel_for(count, recalc_grain,
+					boost::bind(&spreadsheet_session::evaluate_cells, this, level, _1, _2));
+		}
+	}
+
+	/* Evaluates the formulas among cells[begin] to cells[end - 1].  Runs on the recalc pool
+	* during a parallel recalculation, so it only writes the values of those cells.
+	*/
+	void evaluate_cells(const dependency_graph::node* cells, std::size_t begin, std::size_t end)
+	{
+		for(std::size_t i = begin; i < end; i++)
+			if(this->formulas[cells[i]])
+			{
+				this->values[cells[i]] = this->formulas[cells[i]]->evaluate(value_lookup(this));
+				this->columns.update(this->cells.key(cells[i]), this->values[cells[i]]);
+			}
+	}
+
+	/* Builds the dependencies of every formula and evaluates them all.  Run once the cells are
+	* loaded.  A file written before cycles were rejected may hold some; the graph must not, so
+	* the cells that close them are cut off as if committed with force, and are circular errors.
+	*/
+	void rebuild_dependencies()
+	{
+		grow_cell_state();
+		std::size_t count = this->formulas.size();
+		for(cell_store::cell_id id = 0; id < count; id++)
+			if(this->formulas[id])
+			{
+				reference_ids(this->formulas[id].get(), this->precedent_ids);
+				this->graph.set_precedents(id, this->precedent_ids);
+			}
+
+		std::vector<dependency_graph::node> cyclic;
+		this->graph.topological_order(this->recalc_order, cyclic);
+		if(!cyclic.empty())
+		{
+			//every cycle runs through these cells, so without their edges the graph has none;
+			//they are then put back one at a time, cutting off each one that closes a loop
+			for(std::size_t i = 0; i < cyclic.size(); i++)
+				this->graph.set_precedents(cyclic[i], std::vector<dependency_graph::node>());
+			for(std::size_t i = 0; i < cyclic.size(); i++)
+			{
+				cell_store::cell_id id = cyclic[i];
+				reference_ids(this->formulas[id].get(), this->precedent_ids);
+				if(this->graph.dependents_of(id, this->precedent_ids, this->recalc_order))
+					this->graph.set_precedents(id, this->precedent_ids);
+				else
+					cut_circular(id);
+			}
+			this->graph.topological_order(this->recalc_order, cyclic);
+		}
+		recalculate(this->recalc_order);
+	}
+
+	/* Looks up referenced cells for formula::evaluate.  Their values are current because cells
+	* are evaluated after the cells they refer to.
+	*/
+	struct value_lookup
+	{
+		explicit value_lookup(const spreadsheet_session* session)
+			: session(session)
+		{
+		}
+
+		cell_value operator()(cell_key key) const
+		{
+			cell_store::cell_id id = session->cells.find(key);
+			if(id == cell_store::npos)
+				return cell_value();
+			return session->values[id];
+		}
+
+		const spreadsheet_session* session;
+	};
+
+	//Member variables
+	//the set of connection holds all the connected clients to the session
+	std::set<tcp_connection::pointer> connected_users;
+	//the contents of every cell, looked up by the cell's coordinates
+	cell_store cells;
+	//the parsed formula of each formula cell, by cell id
+	std::vector<boost::shared_ptr<const formula> > formulas;
+	//the value of each cell, by cell id, kept current as changes are committed
+	std::vector<cell_value> values;
+	//the version that last changed each cell, by cell id, so stale changes can be rebased
+	std::vector<int> changed_at;
+	//the values again, as contiguous columns of numbers for RANGE
+	column_cache columns;
+	//which formula cells refer to which cells, by cell id
+	dependency_graph graph;
+	//reused by commit_cell
+	std::vector<dependency_graph::node> precedent_ids;
+	std::vector<dependency_graph::node> recalc_order;
+	//reused by commit_cells
+	std::vector<dependency_graph::node> batch_ids;
+	//reused by recalculate
+	std::vector<dependency_graph::node> level_cells;
+	std::vector<std::size_t> level_starts;
+	//Spreads big recalculations across cores, shared with the other sessions
+	recalc_pool& recalc_;
+	//Recalculations and levels smaller than this run on the strand's thread alone
+	enum { parallel_threshold = 2048, recalc_grain = 512 };
+	//the changes that can be undone, each the cells it touched with their previous contents
+	//the oldest are forgotten once the log grows past its memory limit
+	undo_log undo_;
+	//changes committed since the last save
+	int unsaved_changes;
+	//the file name is the spreadsheet file name for the session
+	std::string filename;
+	//the xml_name is the xml file the spreadsheet was created with, read when there is no sheet file
+	std::string xml_name;
+	//the sheet_name is the sheet file the session saves to
+	std::string sheet_name;
+	//the current version of the update
+	int ss_version;
+	//the user_count is the total of clients connected to the session
+	int user_count;
+	//the JOIN OK message for join_snapshot_version, built on the first JOIN after a change
+	tcp_connection::shared_message join_snapshot;
+	int join_snapshot_version;
+	
+	//Serializes every handler of the session
+	boost::asio::io_service::strand strand_;
+	//Every committed change since the sheet file was last written
+	change_journal journal_;
+	//Syncs the journal and writes the sheet file off the network threads
+	boost::asio::io_service& background_;
+	//Set while the background thread is syncing the journal or writing the sheet file
+	bool writing_;
+	//Set when the next write should fold the journal into the sheet file
+	bool compact_requested_;
+	//Set when a committed change could not be journaled, until a compaction writes it
+	bool journal_lost_;
+	//The version being made durable, and the SAVEs that are answered once it is
+	int writing_version_;
+	std::vector<save_waiter> saving_;
+	//SAVEs that came in during a write of an older version, answered by the next write
+	std::vector<save_waiter> save_waiters_;
+	//When the running write started, for the save latency
+	boost::uint64_t save_started_;
+	//What the metrics endpoint reports about the session
+	boost::shared_ptr<session_gauges> gauges_;
+	//Set when the spreadsheet could not be loaded, every JOIN is refused
+	bool load_failed_;
+	//JOINs queued on the strand but not added yet
+	boost::atomic<int> joining_;
+	//When the session went idle, 0 while it is in use
+	boost::atomic<boost::uint64_t> idle_since_;
+	//A CHANGE at most this many versions behind is rebased when its cell was not touched since
+	enum { rebase_window = 1024 };
+	//A SAVE compacts once the journal grows past this many bytes
+	enum { compact_threshold = 1 << 20 };
+	
+	/*
+	* Attempt to open the given xml file the spreadsheet is saved on. 
+	*  If a file does not exist, it creates a the xml file
+	*/
+	void open_file(std::string f)
+	{
+		LOG_INFO("Opening file in SS Session: " << this->filename);
+
+		//Files the server wrote itself are read straight from a mapping of the file
+		if(open_mapped(f))
+			return;
+		LOG_INFO("Reading file with the xml parser in SS Session: " << this->filename);
+		 
+		using boost::property_tree::ptree;
+		ptree pt;
+
+		//Open the file
+		read_xml(f, pt);
+		try
+		{
+			//Iterate over the <cell> </cell> modules
+			BOOST_FOREACH(ptree::value_type &v, pt.get_child("spreadsheet"))
+			{
+				const ptree& child = v.second;
+				//Get name and value from module
+				//std::string name = child.get<std::string>("name");
+				//std::string value = child.get<std::string>("contents");
+
+				std::string name = child.get("name", "");
+				std::string value = child.get("contents", "");
+
+				cell_key key;
+				if(value != "" && cell_store::parse_name(name, key))
+				{
+					//Insert into list
+					set_cell(this->cells.intern(key), value);
+				}
+				else if(value != "")
+					LOG_WARN("Skipping invalid cell " << name << " in SS Session: " << this->filename);
+			}
+			
+		}
+		catch(std::exception& e)	{LOG_ERROR("Error occured while opening file in SS Session: " << this->filename); }
+	}
+
+	/*
+	* Loads the cells from a memory mapping of the xml file, without building a property tree:
+	* each name and contents goes from a view into the mapping straight into the cell store.
+	* Returns false, having loaded nothing, if the file is not laid out the way to_xml() writes
+	* it, so open_file can parse it the slow way.
+	*/
+	bool open_mapped(const std::string& f)
+	{
+		mapped_file file;
+		if(!file.open(f))
+			return false;
+		return scan_cells(file.view(), boost::bind(&cell_store::reserve, &this->cells, _1, _2),
+			boost::bind(&spreadsheet_session::load_cell, this, _1, _2));
+	}
+
+	/*
+	* Loads the cells from a memory mapping of the sheet file.  Returns false, having loaded
+	* nothing, if there is no sheet file or it is damaged.  A damaged file is moved aside rather
+	* than overwritten, since the xml file the session falls back to may be older.
+	*/
+	bool open_sheet(const std::string& f)
+	{
+		mapped_file file;
+		if(!file.open(f))
+			return false;
+		LOG_INFO("Opening sheet file in SS Session: " << this->filename);
+		std::string error;
+		if(sheet_file::decode(file.view(), boost::bind(&cell_store::reserve, &this->cells, _1, _2),
+			boost::bind(&spreadsheet_session::load_key, this, _1, _2), error))
+			return true;
+		LOG_ERROR("Error occured while opening sheet file (" << error << ") in SS Session: " << this->filename);
+		std::rename(f.c_str(), (f + ".damaged").c_str());
+		return false;
+	}
+
+	void load_key(cell_key key, boost::string_ref value)
+	{
+		set_cell(this->cells.intern(key), value);
+	}
+
+	void load_cell(boost::string_ref name, boost::string_ref value)
+	{
+		cell_key key;
+		if(!value.empty() && cell_store::parse_name(name, key))
+			set_cell(this->cells.intern(key), value);
+		else if(!value.empty())
+			LOG_WARN("Skipping invalid cell " << name << " in SS Session: " << this->filename);
+	}
+	/*
+	*	The message_received method receives the messages sent from the client to the server
+	*	The session expects the client to send the following message:
+	*	
+	*	When a client attempts to make a change to a cell
+	*	CHANGE
+	*	Name:name 
+	*	Version:version 
+	*	Cell:cell 
+	*	Length:length 
+	*	content 
+	*	
+	*	When a client changes many cells at once, as one change with one version
+	*	BATCH CHANGE
+	*	Name:name
+	*	Version:version
+	*	Count:count
+	*	Length:length
+	*	content, count times:
+	*	Cell:cell
+	*	Length:length
+	*	content
+	*
+	*	When the client reqeuests an update
+	*	UNDO 
+	*	Name:name 
+	*	Version:version 
+	*
+	*	When the client request to save the spreadsheet
+	*	SAVE 
+	*	Name:name
+	*
+	*	When the client leaves the session
+	*	LEAVE 
+	*	Name:name 
+	*
+	*	When the client asks for the value of a cell
+	*	VALUE
+	*	Name:name
+	*	Cell:cell
+	*
+	*	When the client asks for SUM, AVERAGE, MIN or MAX over a range such as A1:B10
+	*	RANGE
+	*	Name:name
+	*	Function:function
+	*	Range:range
+	*
+	*/
+	/*
+	*	Decodes a message from one of the users into a command and applies it.  Messages reach
+	*	the session through its strand in the order they were received, so the strand is the
+	*	session's command queue and apply() is the only code that changes the cells.
+	*/
+	void message_received(tcp_connection::pointer connection, const message& msg)
+	{
+		LOG_DEBUG("Received message: " << msg.command);
+		//nobody joined a session that failed to load
+		if(this->load_failed_)
+			return;
+
+		session_command command;
+		command.connection = connection;
+		command.name = msg.get("Name").to_string();
+		command.version = msg.get_int("Version");
+		command.cell = msg.get("Cell").to_string();
+		command.contents = msg.body.to_string();
+
+		if(msg.command == "CHANGE")
+			command.type = session_command::change;
+		else if(msg.command == "BATCH CHANGE")
+		{
+			command.type = session_command::batch;
+			command.count = msg.get_int("Count");
+		}
+		else if(msg.command == "UNDO")
+			command.type = session_command::undo;
+		else if(msg.command == "SAVE")
+			command.type = session_command::save;
+		else if(msg.command == "LEAVE")
+			command.type = session_command::leave;
+		else if(msg.command == "VALUE")
+			command.type = session_command::value;
+		else if(msg.command == "RANGE")
+		{
+			command.type = session_command::aggregate;
+			command.function = msg.get("Function").to_string();
+			command.range = msg.get("Range").to_string();
+		}
+		else
+			command.type = session_command::unknown;
+
+		apply(command);
+	}
+
+	/*
+	*	The read loop of a connection failed, the client is gone.
+	*/
+	void receive_error(tcp_connection::pointer connection, const boost::system::error_code& error_code)
+	{
+		if(tcp_connection::closed_by_peer(error_code))
+			LOG_INFO("Client disconnected from SS Session: " << this->filename);
+		else
+			LOG_ERROR("Error occured while receiving a message (" << error_code.message() << ") in SS Session: "
+				<< this->filename);
+		remove_user(connection);
+	}
+
+	/*
+	*	Stores what the metrics report about the session.  Must run on the strand.
+	*/
+	void update_gauges()
+	{
+		this->gauges_->users.store(this->user_count, boost::memory_order_relaxed);
+		this->gauges_->undo_depth.store(this->undo_.size(), boost::memory_order_relaxed);
+		this->gauges_->cells.store(this->cells.size(), boost::memory_order_relaxed);
+		std::size_t memory = this->cells.memory_usage() + this->undo_.memory_usage() +
+			this->columns.memory_usage() + this->graph.memory_usage() +
+			this->formulas.capacity() * sizeof(boost::shared_ptr<const formula>) +
+			this->values.capacity() * sizeof(cell_value) + this->changed_at.capacity() * sizeof(int);
+		if(this->join_snapshot)
+			memory += this->join_snapshot->capacity();
+		this->gauges_->memory.store(memory, boost::memory_order_relaxed);
+	}
+
+	void apply_change(const session_command& command)
+	{
+		latency_timer timer(server_metrics::change_latency);
+		LOG_DEBUG("In CHANGE command");
+		LOG_TRACE("Name: " << command.name);
+		LOG_TRACE("Version: " << command.version);
+		LOG_TRACE("Cell: " << command.cell);
+		LOG_TRACE("Length: " << command.contents.length());
+		LOG_TRACE("Content: " << command.contents);
+
+		cell_key key;
+		if(!cell_store::parse_name(command.cell, key))
+		{
+			//send CHANGE FAIL to connection
+			std::string message = "CHANGE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append(command.cell+" is not a valid cell name.\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		//Formulas must parse before they are committed
+		boost::shared_ptr<formula> parsed;
+		if(is_formula(command.contents))
+		{
+			parsed = boost::make_shared<formula>();
+			std::string error;
+			if(!parsed->parse(command.contents, error))
+			{
+				//send CHANGE FAIL to connection
+				std::string message = "CHANGE FAIL\nName:";
+					message.append(command.name+"\n");
+					message.append(error+"\n");
+
+				send_message(command.connection, message);
+				return;
+			}
+		}
+
+		//Validate version #, a change made against an older version is rebased when nothing
+		//since then touched its cell
+		if(command.version != this->ss_version && !can_rebase(command.version, key))
+		{
+			//send CHANGE WAIT to connection
+			server_metrics::instance().add(server_metrics::changes_waited);
+			reply(command.connection, "CHANGE WAIT", command.name, this->ss_version);
+			return;
+		}
+
+		if(command.version == this->ss_version)
+			LOG_DEBUG("Version numbers match");
+		else
+			LOG_DEBUG("Rebasing change from version " << command.version << " onto " << this->ss_version);
+
+		//Every cell is stored under its upper case name
+		std::string cellname = cell_store::name(key);
+		cell_store::cell_id id = this->cells.intern(key);
+
+		//Store previous contents and assign the new ones, unless that makes a cycle
+		std::string previousContents = this->cells.contents(id).to_string();
+		if(!commit_cell(id, command.contents, parsed))
+		{
+			//send CHANGE FAIL to connection
+			std::string message = "CHANGE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append("Formula expression would create a circular dependency.\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		//Push changes onto stack and increment version #
+		if(!this->journal_.append(cellname, command.contents))
+			journal_failed();
+		this->undo_.add_cell(id, previousContents);
+		this->undo_.end_change();
+		this->unsaved_changes++;
+		this->ss_version++;
+		this->changed_at[id] = this->ss_version;
+		server_metrics::instance().add(server_metrics::changes_committed);
+
+		//sendUpdate to all connections except this one
+		send_update(command.connection, cellname, command.contents);
+
+		//send CHANGE OK command to connection
+		reply(command.connection, "CHANGE OK", command.name, this->ss_version);
+	}
+
+	void apply_batch_change(const session_command& command)
+	{
+		latency_timer timer(server_metrics::change_latency);
+		LOG_DEBUG("In BATCH CHANGE command");
+		LOG_TRACE("Name: " << command.name);
+		LOG_TRACE("Version: " << command.version);
+		LOG_TRACE("Count: " << command.count);
+
+		//Every cell name and formula must be valid before any cell is committed
+		std::vector<cell_change> batch;
+		batch.reserve(command.count > 0 ? command.count : 0);
+		std::string reason;
+		boost::string_ref body(command.contents);
+		while(!body.empty() && reason == "")
+		{
+			boost::string_ref cell, contents;
+			if(!next_batch_entry(body, cell, contents))
+			{
+				reason = "Batch content is not a list of cells.";
+				break;
+			}
+			cell_change change;
+			change.contents = contents.to_string();
+			if(!cell_store::parse_name(cell, change.key))
+				reason = cell.to_string() + " is not a valid cell name.";
+			else if(is_formula(change.contents))
+			{
+				boost::shared_ptr<formula> parsed = boost::make_shared<formula>();
+				std::string error;
+				if(parsed->parse(change.contents, error))
+					change.parsed = parsed;
+				else
+					reason = cell_store::name(change.key) + ": " + error;
+			}
+			batch.push_back(change);
+		}
+		if(reason == "" && (batch.empty() || batch.size() != (std::size_t)command.count))
+		{
+			std::ostringstream count;
+			count << batch.size();
+			reason = "Batch holds " + count.str() + " cells, not the Count given.";
+		}
+		if(reason != "")
+		{
+			//send BATCH CHANGE FAIL to connection
+			std::string message = "BATCH CHANGE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append(reason+"\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		//Validate version #, the whole batch is checked against one version and is rebased
+		//only when none of its cells were touched since
+		bool conflict = false;
+		if(command.version != this->ss_version)
+			for(std::size_t i = 0; i < batch.size() && !conflict; i++)
+				conflict = !can_rebase(command.version, batch[i].key);
+		if(conflict)
+		{
+			//send BATCH CHANGE WAIT to connection
+			server_metrics::instance().add(server_metrics::changes_waited);
+			reply(command.connection, "BATCH CHANGE WAIT", command.name, this->ss_version);
+			return;
+		}
+
+		std::size_t failed = commit_cells(batch, false);
+		if(failed != batch.size())
+		{
+			//send BATCH CHANGE FAIL to connection, no cell was changed
+			std::string message = "BATCH CHANGE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append(cell_store::name(batch[failed].key)+": Formula expression would create a circular dependency.\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		//One journal record, one undo entry and one version for the whole batch
+		change_set applied;
+		applied.reserve(batch.size());
+		for(std::size_t i = 0; i < batch.size(); i++)
+		{
+			applied.push_back(change_journal::entry(cell_store::name(batch[i].key), batch[i].contents));
+			this->undo_.add_cell(this->batch_ids[i], batch[i].previous);
+		}
+		this->undo_.end_change();
+		if(!this->journal_.append(applied))
+			journal_failed();
+		this->unsaved_changes++;
+		this->ss_version++;
+		mark_changed(this->batch_ids);
+		server_metrics::instance().add(server_metrics::batch_changes_committed);
+
+		//sendUpdate to all connections except this one
+		send_update_batch(command.connection, applied);
+
+		//send BATCH CHANGE OK command to connection
+		reply(command.connection, "BATCH CHANGE OK", command.name, this->ss_version);
+	}
+
+	/* Undoes a batch change: every cell of it goes back to its previous contents, last cell
+	* first, as one new version.
+	*/
+	void undo_batch(const session_command& command, const std::vector<undo_log::cell>& undone)
+	{
+		std::vector<cell_change> batch(undone.size());
+		change_set reverted;
+		reverted.reserve(undone.size());
+		for(std::size_t i = 0; i < undone.size(); i++)
+		{
+			const undo_log::cell& cell = undone[undone.size() - 1 - i];
+			batch[i].key = this->cells.key(cell.first);
+			batch[i].contents = cell.second;
+			reverted.push_back(change_journal::entry(cell_store::name(batch[i].key), cell.second));
+		}
+
+		//the contents were committed before, so they cannot make a cycle now
+		commit_cells(batch, true);
+		if(!this->journal_.append(reverted))
+			journal_failed();
+		this->ss_version++;
+		mark_changed(this->batch_ids);
+
+		//broadcast to all connections
+		send_update_batch(command.connection, reverted);
+
+		std::string body = encode_batch(reverted);
+		std::ostringstream tail;
+		tail << "Count:" << reverted.size() << "\nLength:" << body.length() << "\n" << body << "\n";
+
+		//send UNDO BATCH OK to this connection
+		reply(command.connection, "UNDO BATCH OK", command.name, this->ss_version, tail.str());
+	}
+
+	void apply_undo(const session_command& command)
+	{
+		latency_timer timer(server_metrics::undo_latency);
+		LOG_DEBUG("In UNDO command");
+
+		//if invalid version #
+		if(command.version != this->ss_version)
+		{
+			//send UNDO WAIT command
+			reply(command.connection, "UNDO WAIT", command.name, this->ss_version);
+			return;
+		}
+		//check changes size
+		if(this->undo_.empty())
+		{
+			//send UNDO END command
+			reply(command.connection, "UNDO END", command.name, this->ss_version);
+			return;
+		}
+
+		//retreive last cell changed and its previous value
+		std::vector<undo_log::cell> undone;
+		this->undo_.pop(undone);
+		this->unsaved_changes++;
+		server_metrics::instance().add(server_metrics::undos);
+		if(undone.size() > 1)
+		{
+			undo_batch(command, undone);
+			return;
+		}
+		
+		cell_store::cell_id id = undone[0].first;
+		std::string cellname = cell_store::name(this->cells.key(id));
+		std::string contents = undone[0].second;
+		
+		//revert change in cells.  The contents were committed before, so they cannot make a
+		//cycle now
+		commit_cell(id, contents, boost::shared_ptr<const formula>(), true);
+		if(!this->journal_.append(cellname, contents))
+			journal_failed();
+
+		//increment version number
+		this->ss_version++;
+		this->changed_at[id] = this->ss_version;
+		
+		//broadcast to all connections
+		send_update(command.connection, cellname, contents);
+
+		std::ostringstream tail;
+		tail << "Cell:" << cellname << "\nLength:" << contents.length() << "\n" << contents << "\n";
+
+		//send UNDO ok to this connection
+		reply(command.connection, "UNDO OK", command.name, this->ss_version, tail.str());
+	}
+
+	void apply_value(const session_command& command)
+	{
+		LOG_DEBUG("In VALUE command");
+
+		cell_key key;
+		if(!cell_store::parse_name(command.cell, key))
+		{
+			//send VALUE FAIL to connection
+			std::string message = "VALUE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append(command.cell+" is not a valid cell name.\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		std::string text;
+		cell_store::cell_id id = this->cells.find(key);
+		if(id != cell_store::npos)
+		{
+			const cell_value& value = this->values[id];
+			if(value.type == cell_value::text)
+				text = this->cells.contents(id).to_string();
+			else
+				value.append_to(text);
+		}
+
+		std::ostringstream tail;
+		tail << "Cell:" << cell_store::name(key) << "\nLength:" << text.length() << "\n" << text << "\n";
+
+		//send VALUE OK to this connection
+		reply(command.connection, "VALUE OK", command.name, this->ss_version, tail.str());
+	}
+
+	void apply_range(const session_command& command)
+	{
+		LOG_DEBUG("In RANGE command");
+
+		std::string reason;
+		cell_key from = 0, to = 0;
+		if(command.function != "SUM" && command.function != "AVERAGE" && command.function != "MIN" &&
+			command.function != "MAX")
+			reason = command.function + " is not SUM, AVERAGE, MIN or MAX.";
+		else if(!column_cache::parse_range(command.range, from, to))
+			reason = command.range + " is not a valid range.";
+		else if(cell_store::row(to) > column_cache::max_rows)
+			reason = "Ranges cannot go past row 1048576.";
+		if(reason != "")
+		{
+			//send RANGE FAIL to connection
+			std::string message = "RANGE FAIL\nName:";
+				message.append(command.name+"\n");
+				message.append(reason+"\n");
+
+			send_message(command.connection, message);
+			return;
+		}
+
+		//An error anywhere in the range is the result, then NaN, then the aggregate itself
+		std::string text;
+		range_totals totals;
+		cell_key error_at;
+		if(!this->columns.total(from, to, totals, error_at))
+			this->values[this->cells.find(error_at)].append_to(text);
+		else if(totals.nan)
+			text = "NaN";
+		else if(command.function == "SUM")
+			cell_value::append_number(totals.sum, text);
+		else if(command.function == "AVERAGE")
+		{
+			if(totals.count == 0)
+				text = cell_value::describe(cell_value::divide_by_zero);
+			else
+				cell_value::append_number(totals.sum / totals.count, text);
+		}
+		else if(command.function == "MIN")
+			cell_value::append_number(totals.count == 0 ? 0 : totals.min, text);
+		else
+			cell_value::append_number(totals.count == 0 ? 0 : totals.max, text);
+
+		std::ostringstream tail;
+		tail << "Function:" << command.function << "\nRange:" << cell_store::name(from) << ":" <<
+			cell_store::name(to) << "\nLength:" << text.length() << "\n" << text << "\n";
+
+		//send RANGE OK to this connection
+		reply(command.connection, "RANGE OK", command.name, this->ss_version, tail.str());
+	}
+
+	/* SAVE OK is only sent once the current version is durable, so the reply waits for the
+	* background thread.  A SAVE that comes in while that version is being made durable waits
+	* for that write; one that comes in while an older version is being written waits for the
+	* next, which every such SAVE shares.
+	*/
+	void apply_save(const session_command& command)
+	{
+		LOG_DEBUG("In SAVE command");
+
+		save_waiter waiter(command.connection, command.name);
+		if(this->writing_ && this->writing_version_ == this->ss_version)
+			this->saving_.push_back(waiter);
+		else
+		{
+			this->save_waiters_.push_back(waiter);
+			save_ss();
+		}
+	}
+
+	/* Saves the spreadsheet with the current data.  Every change is already in the journal, so
+	* a save only has to make the journal durable, which the background thread does; then the
+	* waiting SAVEs are answered.  A save of a long journal, one asked for by compact(), or one
+	* after a change could not be journaled writes the sheet file instead.  Does nothing while a
+	* write is running; the next one starts when it finishes.
+	*/
+	void save_ss()
+	{
+		if(this->writing_)
+			return;
+		this->writing_ = true;
+
+		LOG_INFO("In ss session save_ss for file: " << this->filename);
+
+		LOG_DEBUG("Number of unsaved changes: " << this->unsaved_changes);
+
+		this->writing_version_ = this->ss_version;
+		this->save_started_ = server_metrics::now();
+		this->saving_.swap(this->save_waiters_);
+		int changes = this->unsaved_changes;
+		this->unsaved_changes = 0;
+		if(this->compact_requested_ || this->journal_lost_ || this->journal_.size() > compact_threshold)
+		{
+			LOG_INFO("Compacting journal for SS Session: " << this->filename);
+			//the copy holds the changes the journal lost, so writing it repairs the journal
+			bool repairing = this->journal_lost_;
+			this->compact_requested_ = false;
+			this->journal_lost_ = false;
+			this->journal_.begin_compaction();
+			this->background_.post(boost::bind(&spreadsheet_session::write_snapshot, shared_from_this(),
+				copy_cells(), changes, repairing));
+		}
+		else
+			this->background_.post(boost::bind(&spreadsheet_session::sync_journal, shared_from_this(), changes));
+	}
+
+	/* Called when a committed change could not be appended to the journal.  The change is only
+	* in memory, so every SAVE fails until a compaction writes the cells to the sheet file.
+	*/
+	void journal_failed()
+	{
+		LOG_ERROR("Error occured while journaling a change in SS Session: " << this->filename);
+		this->journal_lost_ = true;
+	}
+
+	/* Copies the cells for the background thread to write.  Only compaction copies them; JOIN
+	* reads the cells in place on the strand.  Must run on the strand.
+	*/
+	boost::shared_ptr<const sheet_snapshot> copy_cells()
+	{
+		//sort first so the copy iterates in order without sorting again
+		this->cells.sort();
+		return boost::make_shared<const sheet_snapshot>(this->cells, this->ss_version);
+	}
+
+	/* Runs on the background thread.  Makes the journal durable up to the last record appended.
+	*/
+	void sync_journal(int changes)
+	{
+		bool synced = this->journal_.sync();
+		strand_.post(boost::bind(&spreadsheet_session::journal_synced, shared_from_this(), changes, synced));
+	}
+
+	void journal_synced(int changes, bool synced)
+	{
+		if(!synced)
+			LOG_ERROR("Error occured while syncing journal in SS Session: " << this->filename);
+		save_finished(changes, synced && !this->journal_lost_);
+	}
+
+	/* Runs on the background thread.  Writes the snapshot, which holds every journaled record
+	* up to begin_compaction(), to the sheet file, then replaces the journal with an empty one.
+	*/
+	void write_snapshot(boost::shared_ptr<const sheet_snapshot> snapshot, int changes, bool repairing)
+	{
+		bool written = change_journal::write_file(this->sheet_name, sheet_file::encode(snapshot->cells));
+		int journal = written ? this->journal_.replace_file() : -1;
+		strand_.post(boost::bind(&spreadsheet_session::snapshot_written, shared_from_this(), changes, written, journal,
+			repairing));
+	}
+
+	void snapshot_written(int changes, bool written, int journal, bool repairing)
+	{
+		//a journal that could not be replaced still holds everything, the sheet file is saved;
+		//one that was replaced but lost the records kept for it lost those changes
+		bool carried = this->journal_.finish_compaction(journal);
+		if(written && journal < 0)
+			LOG_ERROR("Error occured while replacing journal in SS Session: " << this->filename);
+		else if(!carried && journal >= 0)
+		{
+			LOG_ERROR("Error occured while compacting journal in SS Session: " << this->filename);
+			this->journal_lost_ = true;
+		}
+		if(!written)
+		{
+			LOG_ERROR("Error occured while writing sheet file in SS Session: " << this->filename);
+			//the changes the journal lost are still only in memory
+			if(repairing)
+				this->journal_lost_ = true;
+		}
+		save_finished(changes, written && !this->journal_lost_);
+	}
+
+	/* Answers the SAVEs waiting for the write that just finished, then starts the next write if
+	* one was asked for meanwhile.
+	*/
+	void save_finished(int changes, bool saved)
+	{
+		this->writing_ = false;
+		server_metrics::instance().record(server_metrics::save_latency, server_metrics::now() - this->save_started_);
+		server_metrics::instance().add(saved ? server_metrics::saves : server_metrics::save_failures);
+		if(saved)
+		{
+			//The undo log outlives the save, report what it holds
+			LOG_INFO("Undo log holds " << this->undo_.size() << " changes in " << this->undo_.memory_usage()
+				<< " of " << this->undo_.limit() << " bytes for SS Session: " << this->filename);
+		}
+		else
+		{
+			//the changes are still in the journal, but not saved
+			this->unsaved_changes += changes;
+		}
+
+		for(std::size_t i = 0; i < this->saving_.size(); i++)
+		{
+			if(saved)
+				send_message(this->saving_[i].first, "SAVE OK\nName:" + this->saving_[i].second + "\n");
+			else
+				send_message(this->saving_[i].first, "SAVE FAIL\nName:" + this->saving_[i].second +
+					"\nCould not write the spreadsheet to disk.\n");
+		}
+		this->saving_.clear();
+
+		//SAVEs that came in during the write, or a compaction, get a write of their own
+		if(!this->save_waiters_.empty() || this->compact_requested_)
+			save_ss();
+		update_gauges();
+		check_idle();
+	}
+
+	static void add_xml_cell(boost::property_tree::ptree& pt, cell_key key, boost::string_ref contents)
+	{
+		boost::property_tree::ptree & node = pt.add("spreadsheet.cell","");
+
+		node.put("name", cell_store::name(key));
+		node.put("contents", contents.to_string());
+	}
+	
+	/* 
+	*	Relay UPDATE command to all connections BESIDES the one given in the parameter.
+	*/
+	void send_update(tcp_connection::pointer connection, const std::string& cell_name, const std::string& cell_data)
+	{
+		latency_timer timer(server_metrics::update_latency);
+		LOG_DEBUG("Creating UPDATE command for users in SS Session: " << this->filename);
+
+		std::ostringstream length;
+				length << cell_data.length();
+				
+		//Encode the update once, every connection is sent the same buffer
+		boost::shared_ptr<std::string> message = boost::make_shared<std::string>();
+		message->reserve(64 + this->filename.size() + cell_name.size() + cell_data.size());
+		append_head(*message, "UPDATE", this->filename, this->ss_version);
+			message->append("Cell:").append(cell_name).append("\nLength:");
+			message->append(length.str()).append("\n");
+			message->append(cell_data).append("\n");
+
+		LOG_TRACE("Broadcasting message:\n" << *message);
+		broadcast(connection, message);
+	}
+	
+	/*
+	*	Relay UPDATE BATCH, every cell of a batch change under its one version, to all
+	*	connections BESIDES the one given in the parameter.
+	*/
+	void send_update_batch(tcp_connection::pointer connection, const change_set& applied)
+	{
+		latency_timer timer(server_metrics::update_latency);
+		LOG_DEBUG("Creating UPDATE BATCH command for users in SS Session: " << this->filename);
+
+		std::string body = encode_batch(applied);
+		std::ostringstream count;
+				count << applied.size();
+		std::ostringstream length;
+				length << body.length();
+
+		//Encode the update once, every connection is sent the same buffer
+		boost::shared_ptr<std::string> message = boost::make_shared<std::string>();
+		message->reserve(96 + this->filename.size() + body.size());
+		append_head(*message, "UPDATE BATCH", this->filename, this->ss_version);
+			message->append("Count:").append(count.str()).append("\nLength:");
+			message->append(length.str()).append("\n");
+			message->append(body).append("\n");
+
+		LOG_DEBUG("Broadcasting UPDATE BATCH of " << applied.size() << " cells at version " << this->ss_version);
+		broadcast(connection, message);
+	}
+
+	/*
+	*	Queues one encoded message on every connection BESIDES the one given, which is sent
+	*	its own reply.
+	*/
+	void broadcast(tcp_connection::pointer except, tcp_connection::shared_message message)
+	{
+		std::size_t sent = 0;
+		std::set<tcp_connection::pointer>::iterator it;
+		for(it = this->connected_users.begin(); it != this->connected_users.end(); it++)
+		{
+			if(*it == except)
+				continue;
+
+			(*it)->deliver(message);
+			sent++;
+		}
+		server_metrics::instance().add(server_metrics::updates_sent, sent);
+	}
+
+	/* Appends the lines every reply carrying a version starts with: the head, then Name: and
+	* Version:.
+	*/
+	static void append_head(std::string& message, const std::string& head, const std::string& name, int version)
+	{
+		std::ostringstream version_number;
+		version_number << version;
+		message.append(head).append("\nName:");
+		message.append(name).append("\nVersion:");
+		message.append(version_number.str()).append("\n");
+	}
+
+	/* Sends one connection a reply carrying a version.  The tail holds whatever lines follow the
+	* Version: line.
+	*/
+	void reply(tcp_connection::pointer connection, const std::string& head, const std::string& name, int version,
+		const std::string& tail = std::string())
+	{
+		std::string message;
+		message.reserve(32 + head.size() + name.size() + tail.size());
+		append_head(message, head, name, version);
+		message.append(tail);
+		send_message(connection, message);
+	}
+
+	/* Encodes the cells of a change as the body of an UPDATE BATCH or UNDO BATCH OK.
+	*/
+	static std::string encode_batch(const change_set& cells)
+	{
+		std::size_t size = 0;
+		for(std::size_t i = 0; i < cells.size(); i++)
+			size += 24 + cells[i].first.size() + cells[i].second.size();
+		std::string body;
+		body.reserve(size);
+		for(std::size_t i = 0; i < cells.size(); i++)
+			append_batch_entry(body, cells[i].first, cells[i].second);
+		return body;
+	}
+
+	/*
+	*	Sends the xml file to the client when the client joins the session
+	*	The xml head is sent first on a line and the rest of the xml content is sent on the following line
+	*/
+	void send_XML(tcp_connection::pointer connection)
+	{
+		//The cached JOIN OK is good until the next committed change
+		if(!this->join_snapshot || this->join_snapshot_version != this->ss_version)
+		{
+			LOG_DEBUG("Creating XML document in SS Session: " << this->filename);
+
+			//Get the string version of the xml data
+			std::string xmldata = get_current_state();
+			
+			std::ostringstream length;
+					length << xmldata.length();
+
+			//Build JOIN OK command
+			boost::shared_ptr<std::string> message = boost::make_shared<std::string>();
+			message->reserve(64 + this->filename.size() + xmldata.size());
+			append_head(*message, "JOIN OK", this->filename, this->ss_version);
+				message->append("Length:").append(length.str()).append("\n");
+				message->append(xmldata).append("\n");
+
+			this->join_snapshot = message;
+			this->join_snapshot_version = this->ss_version;
+		}
+
+		//Send JOIN OK command, every joiner at this version shares the same buffer
+		connection->deliver(this->join_snapshot);
+	}
+	
+	/*
+	*	The send message sends the messages from the session to the client.
+	* 	The following messages are to be expected from the session:
+	*	
+	*	When the session was succesfully saved:
+	* 	SAVE SP OK
+	*	Name:name
+	*
+	*	If the request to save the session failed:
+	*	SAVE SP FAIL
+	*	Name:name
+	*	message
+	*
+	*	To communicate a committed change to other clients, the server should send
+	*	UPDATE
+	*	Name:name
+	*	Version:version
+	*	Cell:cell
+	*	Length:length
+	*	content of the change
+	*
+	*	To communicate a committed batch change, or the undo of one, to other clients
+	*	UPDATE BATCH
+	*	Name:name
+	*	Version:version
+	*	Count:count
+	*	Length:length
+	*	the Cell:, Length: and content of each cell, in the order they were applied
+	*
+	*	If the update request succeeded, the server should respond with
+	*	UNDO SP OK 
+	*	Name:name 
+	*	Version:version 
+	*	Cell:cell 
+	*	Length:length 
+	*	content 
+	*
+	*	If there are no unsaved changes, the server should respond with
+	*	UNDO SP END
+	*	Name:name
+	*	Version:version
+	*	
+	*	If the client’s version is out of date, the server should respond with 
+	*	When u
+	*	UNDO SP FAIL LF
+	*	Name:name LF
+	*	message LF
+	*		
+	*/
+	void send_message(tcp_connection::pointer connection, std::string message)
+	{
+		LOG_DEBUG("In ss session send_message for file: " << this->filename);
+
+		LOG_TRACE("Sending message:\n" << message);
+
+		//Queue message on the socket
+		connection->deliver(message);
+	}
+};
+
+#endif
@@ -0,0 +1,331 @@
+//
+// tcp_connection.h
+// ~~~~~~~~~~~~~~~~
+//
+// One client's connection: its read loop and its queue of outbound messages.
+//
+
+#ifndef TCP_CONNECTION_H
+#define TCP_CONNECTION_H
+
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread/mutex.hpp>
+#include "message_buffer.h"
+
+using boost::asio::ip::tcp;
+
+/*
+*	The TCP_connection class represents a TCP connection from a client.  
+*	
+*	Each connection runs one read loop for its whole life, so there is exactly one receive
+*	outstanding at a time no matter how much is written to it.  Every complete message is
+*	handed to the connection's current owner: the server until the client joins a spreadsheet,
+*	then that spreadsheet's session.  The owner's handlers run through its strand, if it has one.
+*
+*	Writes never touch the read loop.  deliver() appends to an outbound queue, and whenever no
+*	write is in flight everything queued is flushed with one gather write, so a burst of
+*	messages costs one write per flush rather than one per message.  Queued messages are
+*	immutable and shared, so a broadcast is encoded once and every recipient's queue points
+*	at the same bytes.
+*
+*	A socket must not be used from two threads at once, and messages are delivered from any
+*	thread while the read loop runs on its owner's strand.  So every receive and write is
+*	started on the connection's own strand, io_strand_; only the completed reads are handed to
+*	the owner's strand.
+*
+*	The loop moves through the following states:
+*	created     -> reading       start() issues the first receive
+*	reading     -> dispatching   a receive completed, messages are handed to the owner
+*	dispatching -> reading       the buffer holds no complete message, receive again
+*	dispatching -> closed        the client sent a message too large or badly framed, ERROR is sent
+*	any         -> closed        a receive failed or the owner stopped the connection
+*/
+class tcp_connection
+  : public boost::enable_shared_from_this<tcp_connection>
+{
+public:
+  typedef boost::shared_ptr<tcp_connection> pointer;
+  typedef boost::shared_ptr<const std::string> shared_message;
+  typedef boost::function<void (pointer, const message&)> message_handler;
+  typedef boost::function<void (pointer, const boost::system::error_code&)> error_handler;
+  typedef boost::function<void (shared_message)> message_sink;
+
+  enum state { created, reading, dispatching, closed };
+
+  /*
+  *	The create method creates a pointer to a TCP_Connection.  It takes an io_service reference
+  *	to the socket for the connection.  The connection will destroy it self when it is out of scope.
+  */
+  static pointer create(boost::asio::io_service& io_service)
+  {
+    return pointer(new tcp_connection(io_service));
+  }
+
+  /*
+  *	Creates a connection with no socket behind it.  Everything delivered to it is handed to
+  * sink on the delivering thread instead of being written, so a session can be driven in
+  * process, by the benchmarks for example.  It has no read loop; it is never started.
+  */
+  static pointer create_local(boost::asio::io_service& io_service, message_sink sink)
+  {
+    pointer connection(new tcp_connection(io_service));
+    connection->sink_ = sink;
+    return connection;
+  }
+
+  /*
+  *	The socket method returns the socket for the connection.  The socket can be used
+  * to send and receive messages.
+  */
+  tcp::socket& socket()
+  {
+    return socket_;
+  }
+
+  /*
+  *	Starts the read loop with the given owner.  A null strand means the owner's handlers may
+  * run on any io_service thread.
+  */
+  void start(boost::asio::io_service::strand* strand, message_handler on_message, error_handler on_error)
+  {
+    strand_ = strand;
+    on_message_ = on_message;
+    on_error_ = on_error;
+    read();
+  }
+
+  /*
+  *	Hands the connection to a new owner.  Must be called from one of the current owner's
+  * message handlers; messages still in the buffer go to the new owner on its strand.
+  */
+  void hand_off(boost::asio::io_service::strand* strand, message_handler on_message, error_handler on_error)
+  {
+    strand_ = strand;
+    on_message_ = on_message;
+    on_error_ = on_error;
+    generation_++;
+  }
+
+  /*
+  *	Queues a message to be sent.  Safe to call from any thread; messages are sent in the
+  * order they were delivered.
+  */
+  void deliver(const std::string& message)
+  {
+    deliver(boost::make_shared<const std::string>(message));
+  }
+
+  /*
+  *	Queues a message that may also be queued on other connections.  The bytes are not copied.
+  */
+  void deliver(shared_message message)
+  {
+    if(sink_)
+    {
+      sink_(message);
+      return;
+    }
+    boost::mutex::scoped_lock lock(write_mtx_);
+    if(write_failed_)
+      return;
+    pending_.push_back(message);
+    if(!writing_)
+    {
+      writing_ = true;
+      io_strand_.post(boost::bind(&tcp_connection::start_write, shared_from_this()));
+    }
+  }
+
+  /*
+  *	True if the read loop ended because the client closed or reset the connection, the usual
+  * way a client leaves, as opposed to an error worth reporting.
+  */
+  static bool closed_by_peer(const boost::system::error_code& error_code)
+  {
+    return error_code == boost::asio::error::eof || error_code == boost::asio::error::connection_reset;
+  }
+
+  /*
+  *	Stops the read loop after the message being handled.  The socket closes once the last
+  * reference to the connection is gone.
+  */
+  void stop()
+  {
+    state_ = closed;
+  }
+
+
+private:
+  /*
+  *	This method must be called through the create method.
+  * The TCP_conneciton constructor takes the socket for the connection
+  *
+  */
+  tcp_connection(boost::asio::io_service& io_service)
+    : io_service_(io_service), socket_(io_service), io_strand_(io_service), strand_(NULL), state_(created),
+      generation_(0), writing_(false), write_failed_(false)
+  {
+  }
+
+  void start_write()
+  {
+    boost::mutex::scoped_lock lock(write_mtx_);
+    write();
+  }
+
+  /*
+  *	Sends everything queued so far in one gather write.  Called on io_strand_ with write_mtx_
+  * held.
+  */
+  void write()
+  {
+    in_flight_.swap(pending_);
+    buffers_.clear();
+    for(std::size_t i = 0; i < in_flight_.size(); i++)
+      buffers_.push_back(boost::asio::buffer(*in_flight_[i]));
+
+    boost::asio::async_write(socket_, buffers_,
+        io_strand_.wrap(boost::bind(&tcp_connection::handle_write, shared_from_this(),
+          boost::asio::placeholders::error,
+          boost::asio::placeholders::bytes_transferred)));
+  }
+
+  /*
+  *	Starts the next flush if more messages were queued during the write.  A failed write drops
+  * the queue; the read loop sees the same broken socket and reports it to the owner.
+  */
+  void handle_write(const boost::system::error_code& error_code, size_t /*bytes_transferred*/)
+  {
+    boost::mutex::scoped_lock lock(write_mtx_);
+    in_flight_.clear();
+    if(error_code)
+    {
+      write_failed_ = true;
+      writing_ = false;
+      pending_.clear();
+      return;
+    }
+    if(pending_.empty())
+      writing_ = false;
+    else
+      write();
+  }
+
+  void read()
+  {
+    state_ = reading;
+    io_strand_.post(boost::bind(&tcp_connection::start_read, shared_from_this()));
+  }
+
+  /*
+  *	Issues the receive on io_strand_.  Its completion runs on the owner's strand.
+  */
+  void start_read()
+  {
+    if(strand_)
+      socket_.async_receive(buffer_.prepare(),
+          strand_->wrap(boost::bind(&tcp_connection::handle_read, shared_from_this(),
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred)));
+    else
+      socket_.async_receive(buffer_.prepare(),
+          boost::bind(&tcp_connection::handle_read, shared_from_this(),
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::bytes_transferred));
+  }
+
+  void handle_read(const boost::system::error_code& error_code, size_t bytes_transferred)
+  {
+    if(state_ == closed)
+      return;
+
+    if(error_code)
+    {
+      state_ = closed;
+      on_error_(shared_from_this(), error_code);
+      return;
+    }
+
+    buffer_.commit(bytes_transferred);
+    dispatch();
+  }
+
+  /*
+  *	Hands every complete message in the buffer to the owner, then receives again.  A partial
+  * message stays in the buffer until the rest of it arrives.
+  */
+  void dispatch()
+  {
+    if(state_ == closed)
+      return;
+    state_ = dispatching;
+
+    int generation = generation_;
+    message msg;
+    while(buffer_.next(msg))
+    {
+      on_message_(shared_from_this(), msg);
+
+      if(state_ == closed)
+        return;
+
+      //The owner changed, carry on from the new owner's strand
+      if(generation != generation_)
+      {
+        if(strand_)
+          strand_->post(boost::bind(&tcp_connection::dispatch, shared_from_this()));
+        else
+          io_service_.post(boost::bind(&tcp_connection::dispatch, shared_from_this()));
+        return;
+      }
+    }
+
+    //A message too large or badly framed to read past: the client is told, then the owner
+    //treats it like a failed receive and the connection closes once ERROR is sent
+    if(buffer_.failed())
+    {
+      deliver("ERROR\n");
+      state_ = closed;
+      on_error_(shared_from_this(), boost::asio::error::message_size);
+      return;
+    }
+
+    read();
+  }
+
+  boost::asio::io_service& io_service_;
+  // The socket is used for network communication to and from the connection
+  tcp::socket socket_;
+  // Every operation on the socket is started here
+  boost::asio::io_service::strand io_strand_;
+  // Bytes received but not yet handled as messages
+  message_buffer buffer_;
+  // The current owner of the connection and the strand its handlers run on
+  boost::asio::io_service::strand* strand_;
+  message_handler on_message_;
+  error_handler on_error_;
+  // Where the read loop is
+  state state_;
+  // Bumped on every hand off
+  int generation_;
+  // Guards the outbound queue, messages are delivered from several threads
+  boost::mutex write_mtx_;
+  // Messages waiting for the next flush
+  std::vector<shared_message> pending_;
+  // Messages being written, kept alive until the write completes
+  std::vector<shared_message> in_flight_;
+  std::vector<boost::asio::const_buffer> buffers_;
+  bool writing_;
+  bool write_failed_;
+  // Takes the messages of a local connection
+  message_sink sink_;
+};
+
+#endif
@@ -0,0 +1,218 @@
+//
+// undo_log.h
+// ~~~~~~~~~~
+//
+// Bounded history of the changes to one spreadsheet, for UNDO.
+//
+
+#ifndef UNDO_LOG_H
+#define UNDO_LOG_H
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/*
+*	The undo_log holds, for each committed change, the cells it touched and the contents they
+*	had before, so the change can be undone.  Changes are undone newest first and, once the log
+*	is over its memory limit, forgotten oldest first.
+*
+*	Nothing is stored per change but a count.  Each cell is a 16 byte entry holding its cell id
+*	and the offset and length of its previous contents in an arena of chunks.  Contents are only
+*	ever added at the back of the arena and released from either end, in the same order as the
+*	entries, so each chunk is a run of live bytes that shrinks from the front as old changes are
+*	evicted and from the back as new ones are undone, and a chunk is freed once it is empty.
+*/
+class undo_log
+{
+public:
+	typedef boost::uint32_t cell_id;
+	typedef std::pair<cell_id, std::string> cell;
+
+	explicit undo_log(std::size_t limit)
+		: limit_(limit), open_(0), chunk_bytes_(0)
+	{
+	}
+
+	/*
+	*	Adds a cell and its previous contents to the change being recorded.
+	*/
+	void add_cell(cell_id id, boost::string_ref previous)
+	{
+		entry e;
+		e.cell = id;
+		e.length = previous.size();
+		place(previous, e);
+		entries_.push_back(e);
+		open_++;
+	}
+
+	/*
+	*	Closes the change being recorded, then forgets the oldest changes until the log fits in
+	*	its limit.  A change bigger than the whole limit is not kept at all.
+	*/
+	void end_change()
+	{
+		if(open_ == 0)
+			return;
+		changes_.push_back(open_);
+		open_ = 0;
+		while(!changes_.empty() && memory_usage() > limit_)
+			evict();
+	}
+
+	/*
+	*	Takes the newest change off the log.  cells receives its cells in the order they were
+	*	added.  Returns false if the log is empty.
+	*/
+	bool pop(std::vector<cell>& cells)
+	{
+		cells.clear();
+		if(changes_.empty())
+			return false;
+		boost::uint32_t count = changes_.back();
+		changes_.pop_back();
+
+		cells.resize(count);
+		for(boost::uint32_t i = count; i-- > 0;)
+		{
+			const entry& e = entries_.back();
+			cells[i].first = e.cell;
+			if(e.length != 0)
+			{
+				//the newest contents are always the last live bytes of the last chunk
+				chunk& c = chunks_.back();
+				cells[i].second.assign(&c.bytes[e.offset], e.length);
+				c.end = e.offset;
+				release_back();
+			}
+			entries_.pop_back();
+		}
+		return true;
+	}
+
+	/*
+	*	The number of changes that can be undone.
+	*/
+	std::size_t size() const
+	{
+		return changes_.size();
+	}
+
+	bool empty() const
+	{
+		return changes_.empty();
+	}
+
+	std::size_t limit() const
+	{
+		return limit_;
+	}
+
+	/*
+	*	The bytes held by the log: the arena, the entries and the change counts.
+	*/
+	std::size_t memory_usage() const
+	{
+		return chunk_bytes_ + entries_.size() * sizeof(entry) + changes_.size() * sizeof(boost::uint32_t);
+	}
+
+private:
+	struct entry
+	{
+		cell_id cell;
+		boost::uint32_t length;
+		// Where the contents start in the chunk that holds them
+		std::size_t offset;
+	};
+
+	/*
+	*	Live bytes are bytes[begin] up to bytes[end].
+	*/
+	struct chunk
+	{
+		std::vector<char> bytes;
+		std::size_t begin;
+		std::size_t end;
+	};
+
+	enum { chunk_size = 64 * 1024 };
+
+	/*
+	*	Copies contents to the back of the arena, starting a new chunk if the last one is full.
+	*	Contents bigger than a chunk get a chunk of their own.  Empty contents, the previous
+	*	contents of every new cell, take no space at all.
+	*/
+	void place(boost::string_ref contents, entry& e)
+	{
+		e.offset = 0;
+		if(contents.empty())
+			return;
+		if(chunks_.empty() || chunks_.back().bytes.size() - chunks_.back().end < contents.size())
+		{
+			chunks_.push_back(chunk());
+			chunk& fresh = chunks_.back();
+			fresh.bytes.resize(std::max<std::size_t>(contents.size(), chunk_size));
+			fresh.begin = fresh.end = 0;
+			chunk_bytes_ += fresh.bytes.size();
+		}
+		chunk& c = chunks_.back();
+		e.offset = c.end;
+		std::copy(contents.begin(), contents.end(), c.bytes.begin() + c.end);
+		c.end += contents.size();
+	}
+
+	/*
+	*	Forgets the oldest change.
+	*/
+	void evict()
+	{
+		boost::uint32_t count = changes_.front();
+		changes_.pop_front();
+		for(boost::uint32_t i = 0; i < count; i++)
+		{
+			const entry& e = entries_.front();
+			if(e.length != 0)
+			{
+				//the oldest contents are always the first live bytes of the first chunk
+				chunk& c = chunks_.front();
+				c.begin = e.offset + e.length;
+				release_front();
+			}
+			entries_.pop_front();
+		}
+	}
+
+	void release_front()
+	{
+		while(!chunks_.empty() && chunks_.front().begin == chunks_.front().end)
+		{
+			chunk_bytes_ -= chunks_.front().bytes.size();
+			chunks_.pop_front();
+		}
+	}
+
+	void release_back()
+	{
+		while(!chunks_.empty() && chunks_.back().begin == chunks_.back().end)
+		{
+			chunk_bytes_ -= chunks_.back().bytes.size();
+			chunks_.pop_back();
+		}
+	}
+
+	std::size_t limit_;
+	// Entries of the change being recorded, at the back of entries_
+	boost::uint32_t open_;
+	// The number of cells in each change, oldest first
+	std::deque<boost::uint32_t> changes_;
+	std::deque<entry> entries_;
+	std::deque<chunk> chunks_;
+	std::size_t chunk_bytes_;
+};
+
+#endif
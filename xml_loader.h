@@ -0,0 +1,373 @@
+//
+// xml_loader.h
+// ~~~~~~~~~~~~
+//
+// Memory mapped, streaming reader for the spreadsheet xml files the server writes.
+//
+
+#ifndef XML_LOADER_H
+#define XML_LOADER_H
+
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/cstdint.hpp>
+#include <boost/utility/string_ref.hpp>
+
+/*
+*	Finds c in text with memchr, which scans many bytes at a time.
+*/
+inline std::size_t find_char(boost::string_ref text, char c)
+{
+	const void* found = text.empty() ? NULL : std::memchr(text.data(), c, text.size());
+	return found == NULL ? boost::string_ref::npos : static_cast<const char*>(found) - text.data();
+}
+
+/*
+*	A read only memory mapping of a whole file.  The mapping is released when the object is
+*	destroyed, so views into it must not outlive it.
+*/
+class mapped_file
+{
+public:
+	mapped_file()
+		: data_(NULL), size_(0)
+	{
+	}
+
+	~mapped_file()
+	{
+		if(data_ != NULL)
+			::munmap(data_, size_);
+	}
+
+	/*
+	*	Maps the file at path.  Returns false if it cannot be opened or is empty.
+	*/
+	bool open(const std::string& path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0)
+			return false;
+		struct stat info;
+		if(::fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			::close(fd);
+			return false;
+		}
+		void* data = ::mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		//the mapping keeps the file alive on its own
+		::close(fd);
+		if(data == MAP_FAILED)
+			return false;
+		::madvise(data, info.st_size, MADV_SEQUENTIAL);
+		data_ = data;
+		size_ = info.st_size;
+		return true;
+	}
+
+	boost::string_ref view() const
+	{
+		return boost::string_ref(static_cast<const char*>(data_), size_);
+	}
+
+private:
+	mapped_file(const mapped_file&);
+	mapped_file& operator=(const mapped_file&);
+
+	void* data_;
+	std::size_t size_;
+};
+
+/*
+*	The xml_cell_scanner walks a document laid out the way the server writes spreadsheets
+*
+*	<?xml version="1.0" encoding="utf-8"?>
+*	<spreadsheet>
+*		<cell>
+*			<name>A1</name>
+*			<contents>5</contents>
+*		</cell>
+*	</spreadsheet>
+*
+*	and hands out the name and contents of each cell as views into the document, still xml
+*	encoded; decode_xml_text() decodes them.  It never allocates.  The name and contents may
+*	come in either order and either may be missing, in which case it is empty.  Anything else
+*	(comments, CDATA, attributes, other elements) stops the scan and marks it failed, so the
+*	caller can fall back to a full xml parser for files written some other way.
+*/
+class xml_cell_scanner
+{
+public:
+	explicit xml_cell_scanner(boost::string_ref document)
+		: rest_(document), state_(before)
+	{
+	}
+
+	/*
+	*	Moves to the next cell.  Returns false at the end of the document or when the scan
+	*	failed.
+	*/
+	bool next(boost::string_ref& name, boost::string_ref& contents)
+	{
+		if(state_ == before && !open_document())
+			return false;
+		if(state_ != inside)
+			return false;
+
+		//text between cells is not part of any cell
+		std::size_t open = find_char(rest_, '<');
+		if(open == boost::string_ref::npos)
+			return fail();
+		rest_.remove_prefix(open);
+
+		if(take("</spreadsheet>"))
+		{
+			skip_space();
+			state_ = rest_.empty() ? finished : broken;
+			return false;
+		}
+		if(!take("<cell>"))
+			return fail();
+
+		name = boost::string_ref();
+		contents = boost::string_ref();
+		bool have_name = false, have_contents = false;
+		for(;;)
+		{
+			skip_space();
+			if(take("</cell>"))
+				return true;
+			if(!have_name && element("name", name))
+				have_name = true;
+			else if(!have_contents && element("contents", contents))
+				have_contents = true;
+			else
+				return fail();
+		}
+	}
+
+	/*
+	*	True once the scan stopped on something it does not understand.
+	*/
+	bool failed() const
+	{
+		return state_ == broken;
+	}
+
+private:
+	enum state { before, inside, finished, broken };
+
+	bool open_document()
+	{
+		skip_space();
+		if(rest_.starts_with("<?xml"))
+		{
+			std::size_t end = rest_.find("?>");
+			if(end == boost::string_ref::npos)
+				return fail();
+			rest_.remove_prefix(end + 2);
+			skip_space();
+		}
+		if(take("<spreadsheet/>"))
+		{
+			skip_space();
+			state_ = rest_.empty() ? finished : broken;
+			return false;
+		}
+		if(!take("<spreadsheet>"))
+			return fail();
+		state_ = inside;
+		return true;
+	}
+
+	/*
+	*	Reads <tag>text</tag> or <tag/> into text.
+	*/
+	bool element(const char* tag, boost::string_ref& text)
+	{
+		std::size_t length = std::strlen(tag);
+		if(rest_.size() < length + 2 || rest_[0] != '<' || rest_.substr(1, length) != tag)
+			return false;
+		boost::string_ref after = rest_.substr(length + 1);
+		if(after.starts_with("/>"))
+		{
+			rest_ = after.substr(2);
+			text = boost::string_ref();
+			return true;
+		}
+		if(!after.starts_with(">"))
+			return false;
+		after.remove_prefix(1);
+
+		//the text runs to the next tag, which must close this element
+		std::size_t close = find_char(after, '<');
+		if(close == boost::string_ref::npos || after.size() < close + length + 3 ||
+			after[close + 1] != '/' || after.substr(close + 2, length) != tag || after[close + 2 + length] != '>')
+			return false;
+		text = after.substr(0, close);
+		rest_ = after.substr(close + length + 3);
+		return true;
+	}
+
+	bool take(const char* literal)
+	{
+		if(!rest_.starts_with(literal))
+			return false;
+		rest_.remove_prefix(std::strlen(literal));
+		return true;
+	}
+
+	void skip_space()
+	{
+		std::size_t i = 0;
+		while(i < rest_.size() && (rest_[i] == ' ' || rest_[i] == '\t' || rest_[i] == '\r' || rest_[i] == '\n'))
+			i++;
+		rest_.remove_prefix(i);
+	}
+
+	bool fail()
+	{
+		state_ = broken;
+		return false;
+	}
+
+	boost::string_ref rest_;
+	state state_;
+};
+
+/*
+*	Decodes the character references in xml text: the five named entities and &#n; / &#xn;.
+*	Returns a view of raw itself when there is nothing to decode, otherwise a view of the
+*	decoded text in scratch.  Returns false, as a full xml parser would fail, for a reference
+*	it does not know.
+*/
+inline bool decode_xml_text(boost::string_ref raw, std::string& scratch, boost::string_ref& text)
+{
+	std::size_t amp = find_char(raw, '&');
+	if(amp == boost::string_ref::npos)
+	{
+		text = raw;
+		return true;
+	}
+
+	scratch.assign(raw.data(), amp);
+	raw.remove_prefix(amp);
+	while(!raw.empty())
+	{
+		if(raw[0] != '&')
+		{
+			amp = find_char(raw, '&');
+			if(amp == boost::string_ref::npos)
+				amp = raw.size();
+			scratch.append(raw.data(), amp);
+			raw.remove_prefix(amp);
+			continue;
+		}
+
+		std::size_t semicolon = find_char(raw, ';');
+		if(semicolon == boost::string_ref::npos)
+			return false;
+		boost::string_ref entity = raw.substr(1, semicolon - 1);
+		raw.remove_prefix(semicolon + 1);
+		if(entity == "lt")
+			scratch += '<';
+		else if(entity == "gt")
+			scratch += '>';
+		else if(entity == "amp")
+			scratch += '&';
+		else if(entity == "quot")
+			scratch += '"';
+		else if(entity == "apos")
+			scratch += '\'';
+		else if(entity.size() > 1 && entity[0] == '#')
+		{
+			boost::uint32_t code = 0;
+			bool hex = entity[1] == 'x';
+			std::size_t i = hex ? 2 : 1;
+			if(i == entity.size())
+				return false;
+			for(; i < entity.size(); i++)
+			{
+				char c = entity[i];
+				int digit;
+				if(c >= '0' && c <= '9')
+					digit = c - '0';
+				else if(hex && c >= 'a' && c <= 'f')
+					digit = c - 'a' + 10;
+				else if(hex && c >= 'A' && c <= 'F')
+					digit = c - 'A' + 10;
+				else
+					return false;
+				code = code * (hex ? 16 : 10) + digit;
+				if(code > 0x10ffff)
+					return false;
+			}
+
+			//as utf-8
+			if(code < 0x80)
+				scratch += static_cast<char>(code);
+			else if(code < 0x800)
+			{
+				scratch += static_cast<char>(0xc0 | (code >> 6));
+				scratch += static_cast<char>(0x80 | (code & 0x3f));
+			}
+			else if(code < 0x10000)
+			{
+				scratch += static_cast<char>(0xe0 | (code >> 12));
+				scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+				scratch += static_cast<char>(0x80 | (code & 0x3f));
+			}
+			else
+			{
+				scratch += static_cast<char>(0xf0 | (code >> 18));
+				scratch += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+				scratch += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+				scratch += static_cast<char>(0x80 | (code & 0x3f));
+			}
+		}
+		else
+			return false;
+	}
+	text = scratch;
+	return true;
+}
+
+/*
+*	Reads the cells of a document in two passes.  The first checks the whole document and
+*	calls reserve(count, bytes) with the number of cells and the size of their contents; the
+*	second calls cell(name, contents) with the decoded text of each cell, in document order.
+*	Returns false, having called neither, if the document cannot be scanned.
+*/
+template <typename Reserve, typename Cell>
+bool scan_cells(boost::string_ref document, Reserve reserve, Cell cell)
+{
+	std::size_t count = 0, bytes = 0;
+	boost::string_ref name, contents, text;
+	std::string scratch, name_scratch;
+	xml_cell_scanner check(document);
+	while(check.next(name, contents))
+	{
+		if(!decode_xml_text(name, scratch, text) || !decode_xml_text(contents, scratch, text))
+			return false;
+		count++;
+		bytes += contents.size();
+	}
+	if(check.failed())
+		return false;
+	reserve(count, bytes);
+
+	xml_cell_scanner scanner(document);
+	while(scanner.next(name, contents))
+	{
+		decode_xml_text(name, name_scratch, name);
+		decode_xml_text(contents, scratch, contents);
+		cell(name, contents);
+	}
+	return true;
+}
+
+#endif